@@ -649,101 +649,125 @@ const char * METATYPES[] = {
     [META_NONE]     = "-"
 };
 
-metadata * clone_metadata(metadata *meta) {
+// allocate a set for the given keys, all entries initialized as not present
+metaset * alloc_metadata(uint32_t present) {
+    int n = __builtin_popcount(present);
+    metaset *ms = calloc(1, sizeof(metaset)+n*sizeof(metadata));
+    ms->present = present;
+
+    int i=0;
+    uint32_t bits = present;
+    while (bits) {
+        ms->m[i].key = __builtin_ctz(bits);
+        ms->m[i].type = META_NONE;
+        bits &= bits-1;
+        i++;
+    }
+    return ms;
+}
+
+// deep copy of a single value
+static void copy_meta_value(metadata *dst, metadata *src) {
+    *dst = *src;
+    switch (src->type) {
+        case META_SLOT:
+            dst->slot.nbt = NULL; // clone_slot frees whatever dst points to
+            clone_slot(&src->slot, &dst->slot);
+            break;
+        case META_NBT:
+            dst->nbt = nbt_clone(src->nbt);
+            break;
+        case META_STRING:
+        case META_CHAT:
+            dst->str = strdup(src->str);
+            break;
+    }
+}
+
+static void free_meta_value(metadata *mm) {
+    switch (mm->type) {
+        case META_SLOT:
+            clear_slot(&mm->slot);
+            break;
+        case META_NBT:
+            nbt_free(mm->nbt);
+            break;
+        case META_STRING:
+        case META_CHAT:
+            lh_free(mm->str);
+            break;
+    }
+}
+
+metaset * clone_metadata(metaset *meta) {
     if (!meta) return NULL;
-    lh_create_num(metadata, newmeta, 32);
-    memmove(newmeta, meta, 32*sizeof(metadata));
+    metaset *newmeta = alloc_metadata(meta->present);
     int i;
-    for(i=0; i<32; i++) {
-        switch (newmeta[i].type) {
-            case META_SLOT:
-                clone_slot(&meta[i].slot, &newmeta[i].slot);
-                break;
-            case META_NBT:
-                newmeta[i].nbt = nbt_clone(meta[i].nbt);
-                break;
-            case META_STRING:
-            case META_CHAT:
-                newmeta[i].str = strdup(meta[i].str);
-                break;
-        }
-    }
+    for(i=0; i<META_COUNT(meta); i++)
+        copy_meta_value(newmeta->m+i, meta->m+i);
     return newmeta;
 }
 
-metadata * update_metadata(metadata *meta, metadata *upd) {
+// apply the keys from upd to the stored set. Only the keys present in upd
+// are touched. The set is reallocated if upd brings new keys, so the caller
+// must use the returned pointer
+metaset * update_metadata(metaset *meta, metaset *upd) {
     if (!meta) return NULL;
     if (!upd)  return meta;
 
+    if (upd->present & ~meta->present) {
+        // merge into a larger set - old values are moved, not copied
+        metaset *ms = alloc_metadata(meta->present|upd->present);
+        int i;
+        for(i=0; i<META_COUNT(meta); i++)
+            *get_metadata(ms, meta->m[i].key) = meta->m[i];
+        free(meta);
+        meta = ms;
+    }
+
     int i;
-    for(i=0; i<32; i++) {
-        if (upd[i].type != 0xff) {
-            if (meta[i].type != upd[i].type) {
-                printf("update_metadata : incompatible metadata types at index %d : old=%d vs new=%d\n",
-                       i, meta[i].type, upd[i].type);
-                continue;
-            }
-
-            // replace stored metadata with the one from the packet
-            switch (meta[i].type) {
-                case META_SLOT:
-                    clear_slot(&meta[i].slot);
-                    clone_slot(&upd[i].slot, &meta[i].slot);
-                    break;
-                case META_NBT:
-                    nbt_free(meta[i].nbt);
-                    meta[i].nbt = nbt_clone(upd[i].nbt);
-                    break;
-                case META_STRING:
-                case META_CHAT:
-                    lh_free(meta[i].str);
-                    meta[i].str = strdup(upd[i].str);
-                    break;
-                default:
-                    meta[i] = upd[i];
-            }
+    for(i=0; i<META_COUNT(upd); i++) {
+        metadata *u  = upd->m+i;
+        metadata *mm = get_metadata(meta, u->key);
+
+        if (mm->type == META_NONE) {
+            // new key
+            copy_meta_value(mm, u);
+            continue;
+        }
+
+        if (mm->type != u->type) {
+            printf("update_metadata : incompatible metadata types at index %d : old=%d vs new=%d\n",
+                   u->key, mm->type, u->type);
+            continue;
         }
+
+        // replace stored metadata with the one from the packet
+        free_meta_value(mm);
+        copy_meta_value(mm, u);
     }
     return meta;
 }
 
 
-void free_metadata(metadata *meta) {
+void free_metadata(metaset *meta) {
     if (!meta) return;
     int i;
-    for(i=0; i<32; i++) {
-        switch (meta[i].type) {
-            case META_SLOT:
-                clear_slot(&meta[i].slot);
-                break;
-            case META_NBT:
-                nbt_free(meta[i].nbt);
-                break;
-            case META_STRING:
-            case META_CHAT:
-                lh_free(meta[i].str);
-                break;
-        }
-    }
+    for(i=0; i<META_COUNT(meta); i++)
+        free_meta_value(meta->m+i);
     free(meta);
 }
 
-uint8_t * read_metadata(uint8_t *p, metadata **meta) {
+uint8_t * read_metadata(uint8_t *p, metaset **meta) {
     assert(meta);
     assert(!*meta);
-    ssize_t mc = 0;
 
-    // allocate a whole set of 32 values
-    lh_alloc_num(*meta, 32);
-    metadata *m = *meta;
+    // parse into a full temporary set, then keep only the keys we got
+    metadata m[32];
+    uint32_t present = 0;
 
-    int i;
     int bool;
 
-    // mark all entries as not present - we use the same 0xff value
-    // that Mojang uses as terminator
-    for(i=0; i<32; i++) m[i].type = META_NONE;
-
     char sbuf[MCP_MAXSTR];
 
     while (1) {
@@ -752,6 +776,10 @@ uint8_t * read_metadata(uint8_t *p, metadata **meta) {
         assert(key < 32);
 
         metadata *mm = &m[key];
+        if (present & (1U<<key)) free_meta_value(mm); // repeated key
+        present |= 1U<<key;
+
+        CLEAR(*mm);
         mm->key = key;
         mm->type = read_char(p);
 
@@ -760,12 +788,10 @@ uint8_t * read_metadata(uint8_t *p, metadata **meta) {
             case META_VARINT:   mm->i = read_varint(p);  break;
             case META_FLOAT:    mm->f = read_float(p);   break;
             case META_STRING:
-            case META_CHAT:     lh_free(mm->str);
-                                p = read_string(p,sbuf);
+            case META_CHAT:     p = read_string(p,sbuf);
                                 mm->str = strdup(sbuf);
                                 break;
-            case META_SLOT:     clear_slot(&mm->slot);
-                                p = read_slot(p,&mm->slot);
+            case META_SLOT:     p = read_slot(p,&mm->slot);
                                 break;
             case META_BOOL:     mm->bool = read_char(p);  break; //VERIFY
             case META_VEC3:     mm->fx=read_float(p);
@@ -788,22 +814,28 @@ uint8_t * read_metadata(uint8_t *p, metadata **meta) {
                                 }
                                 break;
             case META_BID:      mm->block = read_char(p); break; // note- block ID only, no meta
-            case META_NBT:      nbt_free(mm->nbt);
-                                mm->nbt = nbt_parse(&p);
+            case META_NBT:      mm->nbt = nbt_parse(&p);
                                 break;
         }
     }
 
+    // values are moved into the compact set
+    metaset *ms = alloc_metadata(present);
+    int i;
+    for(i=0; i<META_COUNT(ms); i++)
+        ms->m[i] = m[ms->m[i].key];
+    *meta = ms;
+
     return p;
 }
 
-uint8_t * write_metadata(uint8_t *w, metadata *meta) {
+uint8_t * write_metadata(uint8_t *w, metaset *meta) {
     assert(meta);
 
     int i,j;
     char bool;
-    for (i=0; i<32; i++) {
-        metadata *mm = meta+i;
+    for (i=0; i<META_COUNT(meta); i++) {
+        metadata *mm = meta->m+i;
         if (mm->type==META_NONE) continue;
 
         lh_write_char(w, mm->key);
@@ -846,12 +878,12 @@ uint8_t * write_metadata(uint8_t *w, metadata *meta) {
     return w;
 }
 
-void dump_metadata(metadata *meta, EntityType et) {
+void dump_metadata(metaset *meta, EntityType et) {
     if (!meta) return;
 
     int i;
-    for (i=0; i<32; i++) {
-        metadata *mm = meta+i;
+    for (i=0; i<META_COUNT(meta); i++) {
+        metadata *mm = meta->m+i;
         if (mm->type==META_NONE) continue;
 
         printf("\n    ");
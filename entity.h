@@ -198,12 +198,31 @@ typedef struct {
     };
 } metadata;
 
+// sparse set of metadata values - only the keys actually present are
+// stored, ordered by key. Bit N in present is set if key N is in the set,
+// so the position of a key in m[] is the number of present keys below it
+typedef struct {
+    uint32_t        present;
+    metadata        m[];
+} metaset;
+
+#define META_COUNT(ms) __builtin_popcount((ms)->present)
+
+// O(1) lookup of a metadata key, NULL if the key is not present
+static inline metadata * get_metadata(metaset *ms, int key) {
+    if (!ms || key<0 || key>=32) return NULL;
+    uint32_t bit = 1U<<key;
+    if (!(ms->present & bit)) return NULL;
+    return ms->m + __builtin_popcount(ms->present & (bit-1));
+}
+
 extern const char * METATYPES[];
 
-metadata * clone_metadata(metadata *meta);
-metadata * update_metadata(metadata *meta, metadata *upd);
-void free_metadata(metadata *meta);
-uint8_t * read_metadata(uint8_t *p, metadata **meta);
-uint8_t * write_metadata(uint8_t *w, metadata *meta);
-void dump_metadata(metadata *meta, EntityType et);
+metaset * alloc_metadata(uint32_t present);
+metaset * clone_metadata(metaset *meta);
+metaset * update_metadata(metaset *meta, metaset *upd);
+void free_metadata(metaset *meta);
+uint8_t * read_metadata(uint8_t *p, metaset **meta);
+uint8_t * write_metadata(uint8_t *w, metaset *meta);
+void dump_metadata(metaset *meta, EntityType et);
 
@@ -350,6 +350,10 @@ int hud_build_plan  = 0;
 
 uint8_t hud_image[16384];
 
+// last frame transmitted to the client - only the changed area is sent
+uint8_t hud_sent[16384];
+int hud_sent_id     = -1; // map ID the hud_sent frame belongs to, -1 if none
+
 // TODO: color constants
 uint8_t fg_color    = 119; // Black
 uint8_t bg_color    = 0;   // Transparent
@@ -498,6 +502,7 @@ int hud_bind(char *reply, int id) {
     }
 
     hud_id = id;
+    hud_sent_id = -1; // client may have other contents in this map
     return id;
 }
 
@@ -525,6 +530,7 @@ void hud_unbind(char *reply, MCPacketQueue *cq) {
     }
 
     hud_id = -1;
+    hud_sent_id = -1;
 }
 
 // workaround for bug MC-46345 - renew map ID when changing dimension
@@ -817,25 +823,36 @@ int huddraw_map() {
     int32_t x = (int32_t)floor(gs.own.x);
     int32_t y = (int32_t)floor(gs.own.y);
     int32_t z = (int32_t)floor(gs.own.z);
-    extent_t ex = { { x-80, y-12, z-80 }, { x+80, y+3, z+80 } };
-    cuboid_t cb = export_cuboid_extent(ex);
 
-    int r,c,i,j;
-    int32_t off = cb.boff + 16*cb.sa.x + 16;
-    for(r=0; r<128; r++) {
-        for(c=0; c<128; c++) {
-            int poff = off+r*cb.sa.x+c;
-            for(j=0; j<16; j++) {
-                if ( cb.data[j][poff].bid ) {
-                    int8_t color = BLOCK_COLORMAP[cb.data[j][poff].bid][cb.data[j][poff].meta];
-                    hud_image[r*128+c] = color*4 + shading[j];
+    // the map shows the highest block in the y-12..y+3 range - use the
+    // chunk height maps and only scan the columns that have blocks above it
+    int32_t ylo = y-12, yhi = MIN(y+3,255);
+    int32_t xlo = x-64, zlo = z-64;
+
+    int32_t X,Z,bx,bz;
+    for(Z=zlo>>4; Z<=(zlo+127)>>4; Z++) {
+        for(X=xlo>>4; X<=(xlo+127)>>4; X++) {
+            gschunk *gc = find_chunk(gs.world, X, Z, 0);
+            if (!gc) continue;
+
+            for(bz=MAX(Z<<4,zlo); bz<=MIN((Z<<4)+15,zlo+127); bz++) {
+                for(bx=MAX(X<<4,xlo); bx<=MIN((X<<4)+15,xlo+127); bx++) {
+                    int col = ((bz&15)<<4)|(bx&15);
+                    int h = gc->height[col]-1;
+                    if (h > yhi) {
+                        h = yhi;
+                        while (h>=ylo && h>=0 && !gc->blocks[(h<<8)+col].bid) h--;
+                    }
+                    if (h<ylo || h<0) continue;
+
+                    bid_t b = gc->blocks[(h<<8)+col];
+                    int8_t color = BLOCK_COLORMAP[b.bid][b.meta];
+                    hud_image[(bz-zlo)*128+(bx-xlo)] = color*4 + shading[h-ylo];
                 }
             }
         }
     }
 
-    for(i=0; i<256; i++) lh_free(cb.data[i]);
-
     hud_image[64*128+64] = 126;
 
     char text[256];
@@ -852,6 +869,70 @@ int huddraw_map() {
     return 1;
 }
 
+// the tunnel radar stencil reaches 9 blocks around each pixel
+#define TUN_B   9
+#define TUN_W   (128+2*TUN_B)
+
+// number of non-air blocks in the y-2..y+2 column for each x,z around the player
+static uint8_t tun_occ[TUN_W][TUN_W];
+
+// prefix sums of tun_occ along the rows and along the columns
+static int16_t tun_rsum[TUN_W][TUN_W+1];
+static int16_t tun_csum[TUN_W+1][TUN_W];
+
+// tunnel radar values for the 128x128 pixels around x,z - second differences
+// of the block occupancy across x and z, summed over a 16-block window along
+// the other axis and over the layers y-2..y+2
+void hud_tunnel_radar(int32_t x, int32_t y, int32_t z, int16_t *radar) {
+    // fill the occupancy counts directly from the chunk data
+    int32_t xlo = x-64-TUN_B, zlo = z-64-TUN_B;
+    int32_t ylo = MAX(y-2,0), yhi = MIN(y+2,255);
+    memset(tun_occ, 0, sizeof(tun_occ));
+
+    int32_t X,Z,bx,bz,yy;
+    for(Z=zlo>>4; Z<=(zlo+TUN_W-1)>>4; Z++) {
+        for(X=xlo>>4; X<=(xlo+TUN_W-1)>>4; X++) {
+            gschunk *gc = find_chunk(gs.world, X, Z, 0);
+            if (!gc) continue;
+
+            for(bz=MAX(Z<<4,zlo); bz<=MIN((Z<<4)+15,zlo+TUN_W-1); bz++) {
+                for(bx=MAX(X<<4,xlo); bx<=MIN((X<<4)+15,xlo+TUN_W-1); bx++) {
+                    int col = ((bz&15)<<4)|(bx&15);
+                    int n = 0;
+                    for(yy=ylo; yy<=yhi; yy++)
+                        n += (gc->blocks[(yy<<8)+col].bid != 0);
+                    tun_occ[bz-zlo][bx-xlo] = n;
+                }
+            }
+        }
+    }
+
+    int r,c;
+    for(r=0; r<TUN_W; r++) {
+        tun_rsum[r][0] = 0;
+        for(c=0; c<TUN_W; c++)
+            tun_rsum[r][c+1] = tun_rsum[r][c] + tun_occ[r][c];
+    }
+    for(c=0; c<TUN_W; c++) tun_csum[0][c] = 0;
+    for(r=0; r<TUN_W; r++)
+        for(c=0; c<TUN_W; c++)
+            tun_csum[r+1][c] = tun_csum[r][c] + tun_occ[r][c];
+
+// sum of 16 counts in column ocol, rows orow-8..orow+7 and the same along a row
+#define TUN_VSUM(orow,ocol) (tun_csum[(orow)+8][ocol] - tun_csum[(orow)-8][ocol])
+#define TUN_HSUM(orow,ocol) (tun_rsum[orow][(ocol)+8] - tun_rsum[orow][(ocol)-8])
+
+    for(r=0; r<128; r++) {
+        int orow = r+TUN_B;
+        for(c=0; c<128; c++) {
+            int ocol = c+TUN_B;
+            int s1 = TUN_VSUM(orow,ocol-1) - 2*TUN_VSUM(orow,ocol) + TUN_VSUM(orow,ocol+1);
+            int s2 = TUN_HSUM(orow-1,ocol) - 2*TUN_HSUM(orow,ocol) + TUN_HSUM(orow+1,ocol);
+            radar[r*128+c] = MAX(s1,s2);
+        }
+    }
+}
+
 int huddraw_tunnel() {
     if (!(hud_inv & HUDINVMASK_TUNNEL)) return 0;
 
@@ -862,26 +943,14 @@ int huddraw_tunnel() {
     int32_t x = (int32_t)floor(gs.own.x);
     int32_t y = (int32_t)floor(gs.own.y);
     int32_t z = (int32_t)floor(gs.own.z);
-    extent_t ex = { { x-80, y-2, z-80 }, { x+80, y+2, z+80 } };
-    cuboid_t cb = export_cuboid_extent(ex);
 
-    int r,c,i,j;
-    int32_t off = cb.boff + 16*cb.sa.x + 16;
+    static int16_t radar[128*128];
+    hud_tunnel_radar(x, y, z, radar);
+
+    int r,c;
     for(r=0; r<128; r++) {
         for(c=0; c<128; c++) {
-            int poff = off+r*cb.sa.x+c;
-            int s1=0,s2=0;
-            for(i=-8; i<8; i++) {
-                for(j=0; j<5; j++) {
-                    s1+= (cb.data[j][poff-1+i*cb.sa.x].bid != 0)
-                      -2*(cb.data[j][poff+0+i*cb.sa.x].bid != 0)
-                      +  (cb.data[j][poff+1+i*cb.sa.x].bid != 0);
-                    s2+= (cb.data[j][poff+i  -cb.sa.x].bid != 0)
-                      -2*(cb.data[j][poff+i          ].bid != 0)
-                      +  (cb.data[j][poff+i  +cb.sa.x].bid != 0);
-                }
-            }
-            int s = MAX(s1,s2);
+            int s = radar[r*128+c];
             if (s>10) hud_image[r*128+c] = B3(COLOR_RED);
             if (s>30) hud_image[r*128+c] = B3(COLOR_ORANGE);
             if (s>60) hud_image[r*128+c] = B3(COLOR_YELLOW);
@@ -889,8 +958,6 @@ int huddraw_tunnel() {
         }
     }
 
-    for(i=0; i<256; i++) lh_free(cb.data[i]);
-
     hud_image[64*128+64] = B3(COLOR_DIAMOND_BLUE);
 
     char text[256];
@@ -1381,6 +1448,36 @@ void hud_cmd(char **words, MCPacketQueue *sq, MCPacketQueue *cq) {
     if (reply[0]) chat_message(reply, cq, "green", rpos);
 }
 
+// find the bounding rectangle of the pixels that differ from the last
+// transmitted frame. Returns 0 if nothing has changed
+static int hud_dirty_rect(int *col, int *row, int *wd, int *hg) {
+    if (hud_sent_id != hud_id) {
+        // nothing sent to this map yet - full frame
+        *col = *row = 0;
+        *wd = *hg = 128;
+        return 1;
+    }
+
+    int r0,r1,c0=128,c1=-1,r,c;
+    for(r0=0; r0<128 && !memcmp(hud_image+r0*128, hud_sent+r0*128, 128); r0++);
+    if (r0==128) return 0;
+    for(r1=127; r1>r0 && !memcmp(hud_image+r1*128, hud_sent+r1*128, 128); r1--);
+
+    for(r=r0; r<=r1; r++) {
+        uint8_t *a = hud_image+r*128, *b = hud_sent+r*128;
+        for(c=0; c<c0; c++)
+            if (a[c]!=b[c]) { c0=c; break; }
+        for(c=127; c>c1; c--)
+            if (a[c]!=b[c]) { c1=c; break; }
+    }
+
+    *col = c0;
+    *row = r0;
+    *wd  = c1-c0+1;
+    *hg  = r1-r0+1;
+    return 1;
+}
+
 void hud_update(MCPacketQueue *cq) {
     hud_prune();
     if (hud_id < 0 || !hud_inv) return;
@@ -1401,22 +1498,29 @@ void hud_update(MCPacketQueue *cq) {
         default:                break;
     }
 
-    if (updated) {
+    int col,row,wd,hg;
+    if (updated && hud_dirty_rect(&col, &row, &wd, &hg)) {
         NEWPACKET(SP_Map, map);
         tmap->mapid    = hud_id;
         tmap->scale    = 0;
         tmap->trackpos = 0;
         tmap->nicons   = 0;
         tmap->icons    = NULL;
-        tmap->ncols    = 128;
-        tmap->nrows    = 128;
-        tmap->X        = 0;
-        tmap->Z        = 0;
-        tmap->len      = sizeof(hud_image);
-        lh_alloc_num(tmap->data, sizeof(hud_image));
-        memmove(tmap->data, hud_image, sizeof(hud_image));
+        tmap->ncols    = wd;
+        tmap->nrows    = hg;
+        tmap->X        = col;
+        tmap->Z        = row;
+        tmap->len      = wd*hg;
+        lh_alloc_num(tmap->data, wd*hg);
+
+        int r;
+        for(r=0; r<hg; r++)
+            memmove(tmap->data+r*wd, hud_image+(row+r)*128+col, wd);
 
         queue_packet(map, cq);
+
+        memmove(hud_sent, hud_image, sizeof(hud_image));
+        hud_sent_id = hud_id;
     }
 
     hud_inv = HUDINV_NONE;
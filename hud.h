@@ -27,3 +27,5 @@ void hud_cmd(char **words, MCPacketQueue *sq, MCPacketQueue *cq);
 void hud_renew(MCPacketQueue *cq);
 void hud_update(MCPacketQueue *cq);
 void hud_invalidate(uint64_t flags);
+
+void hud_tunnel_radar(int32_t x, int32_t y, int32_t z, int16_t *radar);
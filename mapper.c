@@ -4,9 +4,12 @@
 #include <stdint.h>
 #include <errno.h>
 #include <math.h>
+#include <unistd.h>
 
 #include <lh_image.h>
 
+#include "mcp_quant.h"
+
 typedef struct {
     uint8_t  r,g,b;
     uint16_t bid;
@@ -52,53 +55,44 @@ mapmat_t COLORS[] = {
     { 112,   2,   0, 0x57,  0, 0 },  // Netherrack
 };
 
-float color_diff(uint8_t r, uint8_t g, uint8_t b, int idx, int subidx) {
-    mapmat_t cd = COLORS[idx];
-
-    float f;
-    switch(subidx) {
-        case 0: f=180.0/255.0; break;
-        case 1: f=220.0/255.0; break;
-        case 2: f=1.0; break;
-        case 3: f=135.0/255.0; break;
-    }
-    float dr = (float)COLORS[idx].r*f-r;
-    float dg = (float)COLORS[idx].g*f-g;
-    float db = (float)COLORS[idx].b*f-b;
-    return sqrtf(dr*dr+dg*dg+db*db);
-}
-
-int pick_nearest_color(uint8_t r, uint8_t g, uint8_t b, int *level, int flat) {
-    int i;
-
-    float diff = 1000;
-    int idx = -1; *level=0;
-
-    for(i=0; COLORS[i].bid; i++) {
-        float d_level, d_low, d_high;
-        d_level = color_diff(r,g,b,i,1);
-        if (!flat) {
-            d_low   = color_diff(r,g,b,i,0);
-            d_high  = color_diff(r,g,b,i,2);
-        }
-
-        if (d_level<diff) { idx=i; *level=0; diff=d_level; }
-        if (!flat) {
-            if (d_low<diff)   { idx=i; *level=-1; diff=d_low;   }
-            if (d_high<diff)  { idx=i; *level=1; diff=d_high;  }
+#define NCOLORS (sizeof(COLORS)/sizeof(COLORS[0]))
+
+// map color shades produced by a block depending on the height of the
+// block north of it - same, lower or higher level
+static const float SHADES[3] = { 220.0/255.0, 180.0/255.0, 1.0 };
+static const int   LEVELS[3] = { 0, -1, 1 };
+
+// build the quantizer palette - one entry per material in flat mode,
+// otherwise three entries per material, one for each shade
+quant_t * create_quant(int flat) {
+    int ns = flat ? 1 : 3;
+    qcolor_t *pal = malloc(NCOLORS*ns*sizeof(qcolor_t));
+
+    int i,s;
+    for(i=0; i<NCOLORS; i++) {
+        for(s=0; s<ns; s++) {
+            qcolor_t *c = pal+i*ns+s;
+            c->r = COLORS[i].r*SHADES[s];
+            c->g = COLORS[i].g*SHADES[s];
+            c->b = COLORS[i].b*SHADES[s];
         }
     }
 
-    return idx;
+    quant_t *q = quant_create(pal, NCOLORS*ns);
+    free(pal);
+    return q;
 }
 
-void process_column(lhimage *img, int col, int flat, FILE *out) {
+void process_column(lhimage *img, int16_t *qidx, int col, int flat, FILE *out) {
     int i;
     int clevel = 0, level, prev=0, prevsupport=0;
+    int ns = flat ? 1 : 3;
 
-    for(i=0; i<img->width; i++) {
-        uint32_t color = IMGDOT(img, col, i);
-        int idx = pick_nearest_color((color>>16)&0xff, (color>>8)&0xff, color&0xff, &level, flat);
+    // walk the column from the top, one pixel per image row
+    for(i=0; i<img->height; i++) {
+        int q = qidx[i*img->width+col];
+        int idx = q/ns;
+        level = LEVELS[q%ns];
         int needsupport = COLORS[idx].support;
 
         if ((level<0 && prev>0) || (level>0 && prev<0)) {
@@ -143,30 +137,67 @@ void process_column(lhimage *img, int col, int flat, FILE *out) {
     }
 }
 
+void print_usage(const char *name) {
+    printf("Usage: %s [options] <image.png> <output.csv>\n"
+           "  -s                        : staircase map art using all three shades, default: flat\n"
+           "  -d none|ordered|fs        : dithering mode, default: none\n", name);
+}
+
 int main(int ac, char **av) {
-    if (!av[1] || !av[2]) {
-        printf("Usage: %s <image.png> <output.csv>\n", av[0]);
+    int opt, flat = 1, dither = QDITHER_NONE;
+    while ( (opt=getopt(ac,av,"sd:")) != -1 ) {
+        switch (opt) {
+            case 's':
+                flat = 0;
+                break;
+            case 'd':
+                dither = quant_dither_mode(optarg);
+                if (dither < 0) {
+                    printf("Unknown dithering mode %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage(av[0]);
+                exit(1);
+        }
+    }
+
+    if (!av[optind] || !av[optind+1]) {
+        print_usage(av[0]);
         exit(1);
     }
 
-    lhimage *img = import_png_file(av[1]);
+    lhimage *img = import_png_file(av[optind]);
     if (!img) {
-        printf("Failed to load PNG image from %s\n", av[1]);
+        printf("Failed to load PNG image from %s\n", av[optind]);
         exit(2);
     }
 
     int col;
-    FILE *out = fopen(av[2], "w");
+    FILE *out = fopen(av[optind+1], "w");
     if (!out) {
-        printf("Failed to open file %s for writing: %s\n", av[2], strerror(errno));
+        printf("Failed to open file %s for writing: %s\n", av[optind+1], strerror(errno));
         exit(2);
     }
     fprintf(out, "x,y,z,bid,meta\n");
 
+    // all pixels are mapped, regardless of their transparency
+    int i;
+    for(i=0; i<img->height; i++)
+        for(col=0; col<img->width; col++)
+            IMGDOT(img, col, i) &= 0x00ffffff;
+
+    quant_t *q = create_quant(flat);
+    int16_t *qidx = malloc(img->width*img->height*sizeof(int16_t));
+    quant_image(q, img->data, img->width, img->height, img->stride, dither, qidx);
+
     for(col=0; col<img->width; col++)
-        process_column(img, col, 1, out);
+        process_column(img, qidx, col, flat, out);
 
     fclose(out);
+    free(qidx);
+    quant_free(q);
 
     return 0;
 }
@@ -20,18 +20,101 @@
 
 #include "mcp_bplan.h"
 #include "mcp_ids.h"
+#include "mcp_quant.h"
 
 #define BPP P(bp->plan)
 #define BPC C(bp->plan)
 #define BP  GAR(bp->plan)
 
+////////////////////////////////////////////////////////////////////////////////
+// Voxel grid
+
+// Large buildplans get a dense voxel grid when a bulk manipulation is
+// applied. The grid is kept across manipulations - each one only marks the
+// block list as stale, and the list is rebuilt once by bplan_update.
+// Manipulations working on the block list drop the grid
+
+#define VOX_EMPTY       0xffff      // raw value of an empty voxel
+#define VOX_MINBLOCKS   4096        // smaller buildplans are handled on the block list
+#define VOX_MAXVOLUME   (64<<20)    // largest voxel grid
+#define VOX_MAXSPARSE   32          // largest grid volume per block
+
+#define VOX_OFF(bp,x,y,z) ((x)-(bp)->vx+((z)-(bp)->vz)*(bp)->vsx+((y)-(bp)->vy)*(bp)->vsx*(bp)->vsz)
+#define VOX_VOLUME(bp)    ((int64_t)(bp)->vsx*(bp)->vsy*(bp)->vsz)
+
+// rebuild the block list from the voxel grid, if it's out of date
+static void list_sync(bplan *bp) {
+    if (!bp->vstale) return;
+    bp->vstale = 0;
+
+    int64_t i, n=0, vol = VOX_VOLUME(bp);
+    for(i=0; i<vol; i++)
+        n += (bp->vox[i].raw != VOX_EMPTY);
+
+    lh_arr_free(BP);
+    blkr *b = lh_arr_allocate_c(BP, n);
+
+    int32_t x,y,z;
+    bid_t *v = bp->vox;
+    for(y=0; y<bp->vsy; y++) {
+        for(z=0; z<bp->vsz; z++) {
+            for(x=0; x<bp->vsx; x++,v++) {
+                if (v->raw == VOX_EMPTY) continue;
+                b->x = bp->vx+x;
+                b->y = bp->vy+y;
+                b->z = bp->vz+z;
+                b->b = *v;
+                b++;
+            }
+        }
+    }
+}
+
+// prepare the buildplan for a modification of the block list
+static void list_modify(bplan *bp) {
+    list_sync(bp);
+    lh_free(bp->vox);
+}
+
+// make sure the buildplan has a voxel grid, building it from the block list
+// if necessary. Returns 0 if the buildplan should rather be handled on the list
+static int vox_get(bplan *bp) {
+    if (bp->vox) return 1;
+    if (BPC < VOX_MINBLOCKS) return 0;
+
+    bplan_update(bp);
+    int64_t vol = (int64_t)bp->sx*bp->sy*bp->sz;
+    if (vol > VOX_MAXVOLUME || vol > (int64_t)BPC*VOX_MAXSPARSE) return 0;
+
+    bp->vx = bp->minx;  bp->vsx = bp->sx;
+    bp->vy = bp->miny;  bp->vsy = bp->sy;
+    bp->vz = bp->minz;  bp->vsz = bp->sz;
+    lh_alloc_num(bp->vox, vol);
+    memset(bp->vox, 0xff, vol*sizeof(bid_t));
+
+    int i;
+    for(i=0; i<BPC; i++) {
+        blkr *b = BPP+i;
+        bp->vox[VOX_OFF(bp,b->x,b->y,b->z)] = b->b;
+    }
+
+    return 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void bplan_free(bplan * bp) {
     if (!bp) return;
     lh_arr_free(BP);
+    lh_free(bp->vox);
 }
 
 void bplan_update(bplan * bp) {
+    static uint32_t rev = 0;
+
     assert(bp);
+    list_sync(bp);
+    bp->rev = ++rev;
 
     if (BPC==0) {
         // no blocks in the buildplan
@@ -61,6 +144,7 @@ void bplan_update(bplan * bp) {
 }
 
 void bplan_dump(bplan *bp) {
+    if (bp) list_sync(bp);
     if (!bp || BPC==0) {
         printf("Buildplan is empty\n");
         return;
@@ -83,6 +167,7 @@ void bplan_dump(bplan *bp) {
 // returns the index of the newly added block
 int bplan_add(bplan *bp, blkr block) {
     assert(bp);
+    list_modify(bp);
 
     int i;
     for(i=0; i<BPC; i++) {
@@ -363,8 +448,54 @@ bplan * bplan_seal() {
 ////////////////////////////////////////////////////////////////////////////////
 // Buildplan manipulation
 
+// hollow on the voxel grid - voxels at the grid border are never enclosed
+static int vox_hollow(bplan *bp, int flat, int opaque) {
+    int64_t i, vol = VOX_VOLUME(bp);
+    int32_t sx = bp->vsx, sxz = bp->vsx*bp->vsz;
+
+    // Bit 0 - block is present, Bit 1 - block is considered opaque
+    lh_create_num(uint8_t, v, vol);
+    int removed = 0;
+    for(i=0; i<vol; i++) {
+        bid_t b = bp->vox[i];
+        if (b.raw == VOX_EMPTY) continue;
+        if (!b.bid) {
+            // air blocks are removed
+            bp->vox[i].raw = VOX_EMPTY;
+            removed++;
+            continue;
+        }
+        v[i] = 1;
+        if (!opaque || (ITEMS[b.bid].flags&I_OPAQUE))
+            v[i] |= 2;
+    }
+
+    int32_t x,y,z;
+    for(y=flat?0:1; y<(flat?bp->vsy:bp->vsy-1); y++) {
+        for(z=1; z<bp->vsz-1; z++) {
+            int32_t off = y*sxz+z*sx;
+            for(x=1; x<sx-1; x++) {
+                int32_t o = off+x;
+                if ( (v[o]&1) &&
+                     (v[o-1]&2) && (v[o+1]&2) &&
+                     (v[o-sx]&2) && (v[o+sx]&2) &&
+                     (flat || ((v[o-sxz]&2) && (v[o+sxz]&2))) ) {
+                    bp->vox[o].raw = VOX_EMPTY;
+                    removed++;
+                }
+            }
+        }
+    }
+
+    lh_free(v);
+    bp->vstale = 1;
+    return removed;
+}
+
 int bplan_hollow(bplan *bp, int flat, int opaque) {
     assert(bp);
+    if (vox_get(bp)) return vox_hollow(bp, flat, opaque);
+    list_modify(bp);
     bplan_update(bp);
 
     int i;
@@ -444,6 +575,7 @@ int bplan_hollow(bplan *bp, int flat, int opaque) {
 }
 
 void bplan_extend(bplan *bp, int ox, int oz, int oy, int count) {
+    list_modify(bp);
     int i,j;
     int bc=BPC;
     for(i=1; i<=count; i++) {
@@ -461,6 +593,24 @@ void bplan_extend(bplan *bp, int ox, int oz, int oy, int count) {
 int bplan_replace(bplan *bp, bid_t mat1, bid_t mat2, int anymeta) {
     // TODO: handle material replacement for the orientation-dependent metas
 
+    if (vox_get(bp)) {
+        int64_t i, vol = VOX_VOLUME(bp);
+        uint16_t mask = anymeta ? 0xfff0 : 0xffff;
+        int count=0;
+        for(i=0; i<vol; i++) {
+            bid_t *v = bp->vox+i;
+            if (v->raw == VOX_EMPTY || (v->raw&mask) != (mat1.raw&mask)) continue;
+            count++;
+            if (mat2.bid == 0)
+                v->raw = VOX_EMPTY;
+            else
+                v->raw = (mat2.raw&mask)|(v->raw&~mask);
+        }
+        bp->vstale = 1;
+        return count;
+    }
+    list_modify(bp);
+
     // if mat2=Air, blocks will be removed.
     // this array will store all blocks we keep
     lh_arr_declare_i(blkr, keep);
@@ -494,6 +644,7 @@ int bplan_replace(bplan *bp, bid_t mat1, bid_t mat2, int anymeta) {
 
 // trim the buildplan by erasing block not fitting the criteria
 int bplan_trim(bplan *bp, int type, int32_t value) {
+    list_modify(bp);
     lh_arr_declare_i(blkr, keep);
 
     int i, count=0;
@@ -531,6 +682,39 @@ int bplan_trim(bplan *bp, int type, int32_t value) {
 
 // flip the buildplan across one of the axis
 void bplan_flip(bplan *bp, char mode) {
+    if (mode!='x' && mode!='y' && mode!='z') return;
+
+    if (vox_get(bp)) {
+        lh_create_num(bid_t, v, VOX_VOLUME(bp));
+        int32_t x,y,z;
+        for(y=0; y<bp->vsy; y++) {
+            for(z=0; z<bp->vsz; z++) {
+                bid_t *src = bp->vox+(y*bp->vsz+z)*bp->vsx;
+                int32_t dy = (mode=='y') ? bp->vsy-1-y : y;
+                int32_t dz = (mode=='z') ? bp->vsz-1-z : z;
+                bid_t *dst = v+(dy*bp->vsz+dz)*bp->vsx;
+                for(x=0; x<bp->vsx; x++) {
+                    bid_t b = src[x];
+                    if (b.raw != VOX_EMPTY)
+                        b = (mode=='y') ? flip_meta_y(b) : flip_meta(b, mode);
+                    dst[(mode=='x') ? bp->vsx-1-x : x] = b;
+                }
+            }
+        }
+        lh_free(bp->vox);
+        bp->vox = v;
+
+        // mirror the grid origin
+        switch (mode) {
+            case 'x': bp->vx = -(bp->vx+bp->vsx-1); break;
+            case 'y': bp->vy = -(bp->vy+bp->vsy-1); break;
+            case 'z': bp->vz = -(bp->vz+bp->vsz-1); break;
+        }
+        bp->vstale = 1;
+        return;
+    }
+    list_modify(bp);
+
     int i;
     for(i=0; i<BPC; i++) {
         blkr *b = BPP+i;
@@ -553,6 +737,7 @@ void bplan_flip(bplan *bp, char mode) {
 
 // flip the buildplan across one of the axis
 void bplan_tilt(bplan *bp, char mode) {
+    list_modify(bp);
     int i;
     int32_t x,y,z;
     for(i=0; i<BPC; i++) {
@@ -584,6 +769,7 @@ void bplan_tilt(bplan *bp, char mode) {
 
 // shift the buildplan so that the pivot is at the bottom leftmost near corner
 void bplan_normalize(bplan *bp) {
+    list_modify(bp);
     bplan_update(bp);
     int i;
     for(i=0; i<BPC; i++) {
@@ -602,20 +788,22 @@ void bplan_shrink(bplan *bp) {
 
     int i;
 
-    // size of a single "slice" with additional 1-block border
+    // use the voxel grid directly if there is one, otherwise build
+    // a temporary voxel set from the buildplan
     int32_t size_xz = bp->sx*bp->sz;
-    lh_create_num(bid_t,v,size_xz*bp->sy);
-
-    // initialize the voxel set from the buildplan
-    for(i=0; i<BPC; i++) {
-        blkr *b = BPP+i;
-
-        // offset of this block in the array
-        int32_t off_x = b->x-bp->minx;
-        int32_t off_y = b->y-bp->miny;
-        int32_t off_z = b->z-bp->minz;
-        int32_t off   = off_x+off_z*bp->sx+off_y*size_xz;
-        v[off] = b->b;
+    bid_t *v = bp->vox;
+    if (!v) {
+        lh_alloc_num(v, size_xz*bp->sy);
+        for(i=0; i<BPC; i++) {
+            blkr *b = BPP+i;
+
+            // offset of this block in the array
+            int32_t off_x = b->x-bp->minx;
+            int32_t off_y = b->y-bp->miny;
+            int32_t off_z = b->z-bp->minz;
+            int32_t off   = off_x+off_z*bp->sx+off_y*size_xz;
+            v[off] = b->b;
+        }
     }
 
     // new list for the build plan to hold the blocks from the shrinked model
@@ -625,26 +813,16 @@ void bplan_shrink(bplan *bp) {
     for(y=bp->miny; y<bp->maxy-1; y+=2) {
         for(x=bp->minx; x<bp->maxx-1; x+=2) {
             for(z=bp->minz; z<bp->maxz-1; z+=2) {
-                int32_t off_x = x-bp->minx;
-                int32_t off_y = y-bp->miny;
-                int32_t off_z = z-bp->minz;
-                int32_t off   = off_x+off_z*bp->sx+off_y*size_xz;
-
-                int32_t offs[8] = {
-                    off,
-                    off+1,
-                    off+bp->sx,
-                    off+1+bp->sx,
-                    off+size_xz,
-                    off+1+size_xz,
-                    off+bp->sx+size_xz,
-                    off+1+bp->sx+size_xz
-                };
+                int32_t xs[2] = { x, x+1 }, ys[2] = { y, y+1 }, zs[2] = { z, z+1 };
 
                 int blk[256]; lh_clear_obj(blk);
                 for (i=0; i<8; i++) {
-                    int bid = v[offs[i]].bid;
-                    blk[bid]++;
+                    int32_t off = bp->vox ?
+                        VOX_OFF(bp, xs[i&1], ys[i>>2], zs[(i>>1)&1]) :
+                        xs[i&1]-bp->minx+(zs[(i>>1)&1]-bp->minz)*bp->sx+(ys[i>>2]-bp->miny)*size_xz;
+                    if (v[off].raw == VOX_EMPTY) continue;
+                    int bid = v[off].bid;
+                    if (bid < 256) blk[bid]++;
                 }
                 bid_t mat = BLOCKTYPE(0,0);
                 for(i=1; i<256; i++)
@@ -662,8 +840,9 @@ void bplan_shrink(bplan *bp) {
         }
     }
 
-    // free our voxel set
-    lh_free(v);
+    // free our voxel set and the grid, the result is much smaller
+    if (!bp->vox) lh_free(v);
+    lh_free(bp->vox);
 
     // replace the buildplan with the reduced list
     lh_arr_free(BP);
@@ -677,6 +856,39 @@ void bplan_shrink(bplan *bp) {
 void bplan_scale(bplan *bp, int scale) {
     assert(bp);
 
+    if (vox_get(bp) && VOX_VOLUME(bp)*scale*scale*scale <= VOX_MAXVOLUME) {
+        int32_t nsx = bp->vsx*scale, nsy = bp->vsy*scale, nsz = bp->vsz*scale;
+        lh_create_num(bid_t, v, (int64_t)nsx*nsy*nsz);
+
+        // expand each source row in x, then copy it to all scaled rows
+        int32_t x,y,z,k;
+        bid_t *dst = v;
+        for(y=0; y<bp->vsy; y++) {
+            for(z=0; z<bp->vsz; z++) {
+                bid_t *src = bp->vox+(y*bp->vsz+z)*bp->vsx;
+                bid_t *row = dst;
+                for(x=0; x<bp->vsx; x++)
+                    for(k=0; k<scale; k++)
+                        *dst++ = src[x];
+                for(k=1; k<scale; k++,dst+=nsx)
+                    memmove(dst, row, nsx*sizeof(bid_t));
+            }
+            // copy the whole scaled slice
+            bid_t *slice = dst-nsx*nsz;
+            for(k=1; k<scale; k++,dst+=nsx*nsz)
+                memmove(dst, slice, nsx*nsz*sizeof(bid_t));
+        }
+
+        lh_free(bp->vox);
+        bp->vox = v;
+        bp->vx *= scale;  bp->vsx = nsx;
+        bp->vy *= scale;  bp->vsy = nsy;
+        bp->vz *= scale;  bp->vsz = nsz;
+        bp->vstale = 1;
+        return;
+    }
+    list_modify(bp);
+
     // new list for the build plan to hold the blocks from the scaled model
     lh_arr_declare_i(blkr, keep);
 
@@ -707,6 +919,7 @@ void bplan_scale(bplan *bp, int scale) {
 ////////////////////////////////////////////////////////////////////////////////
 
 int bplan_save(bplan *bp, const char *name) {
+    list_sync(bp);
     char fname[256];
     sprintf(fname, "bplan/%s.bplan", name);
 
@@ -773,18 +986,34 @@ int bplan_ssave(bplan *bp, const char *name) {
     lh_create_num(uint8_t,blocks,size);
     lh_create_num(uint8_t,data,size);
 
-    // initialize the voxel set from the buildplan
-    for(i=0; i<BPC; i++) {
-        blkr *b = BPP+i;
-
-        // offset of this block in the array
-        int32_t off_x = b->x-bp->minx;
-        int32_t off_y = b->y-bp->miny;
-        int32_t off_z = b->z-bp->minz;
-        int32_t off   = off_x+off_z*bp->sx+off_y*size_xz;
-
-        blocks[off] = b->b.bid;
-        data[off]   = b->b.meta;
+    if (bp->vox) {
+        // copy directly from the voxel grid
+        int32_t x,y,z;
+        for(i=0,y=bp->miny; y<=bp->maxy; y++) {
+            for(z=bp->minz; z<=bp->maxz; z++) {
+                bid_t *v = bp->vox+VOX_OFF(bp,bp->minx,y,z);
+                for(x=0; x<bp->sx; x++,i++) {
+                    if (v[x].raw == VOX_EMPTY) continue;
+                    blocks[i] = v[x].bid;
+                    data[i]   = v[x].meta;
+                }
+            }
+        }
+    }
+    else {
+        // initialize the voxel set from the buildplan
+        for(i=0; i<BPC; i++) {
+            blkr *b = BPP+i;
+
+            // offset of this block in the array
+            int32_t off_x = b->x-bp->minx;
+            int32_t off_y = b->y-bp->miny;
+            int32_t off_z = b->z-bp->minz;
+            int32_t off   = off_x+off_z*bp->sx+off_y*size_xz;
+
+            blocks[off] = b->b.bid;
+            data[off]   = b->b.meta;
+        }
     }
 
     // Construct the schematic NBT structure
@@ -967,23 +1196,24 @@ typedef struct {
     bid_t    b;
 } cmap_t;
 
-static inline bid_t match_color(uint32_t c, cmap_t * set) {
-    c &= 0x00ffffff;
-    int i, bi=0, bdiff=0x7fffffff;
-
-    for(i=0; set[i].b.bid; i++) {
-        uint32_t mc = set[i].color;
-        int rd = ((c>>16)&0xff)-((mc>>16)&0xff);
-        int gd = ((c>>8)&0xff) -((mc>>8)&0xff);
-        int bd = (c&0xff)      -(mc&0xff);
-        int diff = rd*rd+gd*gd+bd*bd;
-        if (diff < bdiff) { bi = i; bdiff = diff; }
+// build a quantizer for the colors of a color set
+static quant_t * create_quant(cmap_t *set) {
+    int i,n;
+    for(n=0; set[n].b.bid; n++);
+
+    lh_create_num(qcolor_t, pal, n);
+    for(i=0; i<n; i++) {
+        pal[i].r = (set[i].color>>16)&0xff;
+        pal[i].g = (set[i].color>>8)&0xff;
+        pal[i].b = set[i].color&0xff;
     }
 
-    return set[bi].b;
+    quant_t *q = quant_create(pal, n);
+    lh_free(pal);
+    return q;
 }
 
-bplan * bplan_pngload(const char *name, const char *setname) {
+bplan * bplan_pngload(const char *name, const char *setname, int dither) {
     cmap_t CMAP_WOOL[] = {
         { 0xDEDEDE, BLOCKTYPE(35,0) },  // white
         { 0xdb7d3f, BLOCKTYPE(35,1) },  // orange
@@ -1187,25 +1417,30 @@ bplan * bplan_pngload(const char *name, const char *setname) {
     lhimage *img = import_png_file(fname);
     if (!img) LH_ERROR(NULL, "Failed to open %s as PNG", fname);
 
+    quant_t *q = create_quant(set);
+    lh_create_num(int16_t, qidx, img->width*img->height);
+    quant_image(q, img->data, img->width, img->height, img->stride, dither, qidx);
+
     lh_create_obj(bplan, bp);
     int x,y;
 
     for (y=0; y<img->height; y++) {
         int yy=img->height-y-1;
-        uint32_t *row = img->data+yy*img->stride;
+        int16_t *row = qidx+yy*img->width;
 
         for (x=0; x<img->width; x++) {
-            uint32_t pixel = row[x];
-            if (pixel&0xff000000) continue; // skip transparent pixels
-            bid_t mat = match_color(pixel, set);
+            if (row[x] < 0) continue; // skip transparent pixels
 
             blkr *b = lh_arr_new(BP);
             b->x = x;
             b->y = y;
             b->z = 0;
-            b->b=mat;
+            b->b = set[row[x]].b;
         }
     }
 
+    lh_free(qidx);
+    quant_free(q);
+
     return bp;
 }
@@ -29,6 +29,17 @@ typedef struct {
     int32_t maxx,maxy,maxz;    // max buildplan coordinate in each dimension
     int32_t minx,miny,minz;    // min buildplan coordinate in each dimension
     int32_t sx,sy,sz;          // buildplan size in each dimension
+
+    // optional dense voxel grid, used by the bulk manipulations of large
+    // buildplans. If vstale is set, the grid holds the current buildplan
+    // and the block list is rebuilt from it by the next bplan_update
+    bid_t  *vox;
+    int32_t vx,vy,vz;          // coordinates of the first voxel
+    int32_t vsx,vsy,vsz;       // grid size in each dimension
+    int     vstale;            // block list is out of date
+
+    uint32_t rev;              // modification counter, unique across buildplans
+                               // updated by bplan_update, 0 if never updated
 } bplan;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -37,7 +48,8 @@ typedef struct {
 // free a buildplan object
 void bplan_free(bplan * bp);
 
-// recalculate buildplan extents - called when the buildplan was modified
+// recalculate buildplan extents - called when the buildplan was modified.
+// Also brings the block list up to date if it was modified in the voxel grid
 void bplan_update(bplan * bp);
 
 // dump the contents of the buildplan
@@ -100,4 +112,4 @@ int bplan_ssave(bplan *bp, const char *name);
 bplan * bplan_sload(const char *name);
 int bplan_csvsave(bplan *bp, const char *name);
 bplan * bplan_csvload(const char *name);
-bplan * bplan_pngload(const char *name, const char *setname);
+bplan * bplan_pngload(const char *name, const char *setname, int dither);
@@ -13,6 +13,9 @@
 #include <string.h>
 #include <strings.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <lh_buffers.h>
 #include <lh_files.h>
@@ -26,6 +29,7 @@
 #include "mcp_gamestate.h"
 #include "mcp_game.h"
 #include "mcp_arg.h"
+#include "mcp_quant.h"
 
 
 #define EYEHEIGHT (52.0/32.0)
@@ -151,13 +155,40 @@ typedef struct {
     double dist;                // distance to the block center
 
     uint64_t last;              // last timestamp when we attempted to place this block
+    uint64_t sent;              // timestamp of the placement waiting for the server's answer,
+                                // 0 if none
+    int8_t retried;             // placement was sent again before the answer came
+    int8_t rejects;             // placements answered without the block being placed,
+                                // doubles the wait before the next attempt
+
+    int8_t counted;             // placed state as accounted in the material ledger
+
+    int64_t route;              // position on the planned route, see plan_route()
+
+    int32_t tnb[6];             // buildtask indices of the neighbor blocks, -1 if none -
+                                // the blocks this one can be placed against or support
+    int32_t fpos;               // index+1 in the build frontier, 0 if not in it
 } blk;
 
+// one strip of the planned route
+typedef struct {
+    off3_t  start, end;         // waypoints - first and last block of the strip
+    int64_t rmin, rmax;         // route positions of these blocks
+} rstrip;
+
+// block placed while recording, waiting for the update from the server
+typedef struct {
+    blkr b;
+    int64_t ts;                 // when it was placed, 0 if no longer pending
+} brpend;
+
 // maximum number of blocks in the buildable list
 #define MAXBUILDABLE 1024
 
 struct {
     int64_t lastbuild;         // timestamp of last block placement
+    int64_t srtt;              // smoothed round-trip time of the block placements (us)
+    int64_t rttvar;            // and its mean deviation, both 0 if not measured yet
 
     int active;                // if nonzero - buildtask is being built
     int recording;             // if nonzero - build recording active
@@ -167,10 +198,22 @@ struct {
     lh_arr_declare(blk,task);  // current active building task
     bplan *bp;                 // currently loaded/created buildplan
 
-    blkr brp[MAXBUILDABLE];    // records the 'pending' blocks from the build recorder
-    ssize_t nbrp;              // we add blocks as we place them (CP_PlayerBlockPlacement)
+    int32_t *tidx;             // buildtask blocks hashed by position - open addressing,
+    int32_t ntidx;             // slots hold the task index+1, 0 if empty
+    int32_t *tord;             // buildtask indices ordered by chunk
+
+    lh_arr_declare(int32_t,front); // frontier - buildtask blocks not placed yet, which
+                                   // have something to be placed against
+
+    lh_arr_declare(rstrip,route); // strips of the planned route, in order
+
+    lh_arr_declare(brpend,brp); // records the 'pending' blocks from the build recorder
+                               // we add blocks as we place them (CP_PlayerBlockPlacement)
                                // and remove them as we get the confirmation from the server
-                               // (SP_BlockChange or SP_MultiBlockChange)
+                               // (SP_BlockChange or SP_MultiBlockChange), in placement order
+    ssize_t brphead;           // index of the oldest entry in brp that may be still pending
+    int32_t *brpidx;           // pending blocks hashed by position - open addressing,
+    int32_t nbrpidx;           // slots hold the brp index+1, 0 if empty
 
     pivot_t pv;                // pivot
 
@@ -189,9 +232,11 @@ struct {
 
 struct {
     int init;
-    int blkint;            // interval (in microseconds) between attempting to place same block
+    int blkint;            // max interval (in microseconds) between attempting to place same
+                           // block, if the server did not answer the placement
     int bldint;            // interval between placing any block
     int blkmax;            // maximum number of blocks to be places at once
+    int pktmax;            // maximum number of packets sent to the server at once
     int placemode;         // automatically enter this placement mode once a buildplan is
                            // created, loaded or modified
     int wallmode;          // if nonzero - do not build blocks higher than your own position
@@ -201,6 +246,8 @@ struct {
                            // blocked on some, including 2b2t
     int bjump;             // build while jumping/flying/swimming - this is disabled by default
                            // but useful in some situations, e.g. when building under water
+    int route;             // place blocks in the order of the planned route instead of
+                           // the farthest first
     int preview_retain;    // by default preview is automatically removed when the buildtask
                            // is canceled, otherwise phantom blocks will stay there until
                            // chunks are removed. This option overrides this behavior and
@@ -217,23 +264,28 @@ typedef struct {
 #define BUILD_BLKINT  1000000
 #define BUILD_BLDINT   150000
 #define BUILD_BLKMAX        1
+#define BUILD_PKTMAX       24
+#define BUILD_RTTMIN    50000  // lower limit of the placement retry interval
 
 bopt_t OPTIONS[] = {
-    { "blkint", "interval (us) between attempting to place same block", &buildopts.blkint, BUILD_BLKINT},
+    { "blkint", "max interval (us) between attempting to place same block", &buildopts.blkint, BUILD_BLKINT},
     { "bldint", "interval (us) between attempting to place any block",  &buildopts.bldint, BUILD_BLDINT},
     { "blkmax", "max number of blocks to place at once",                &buildopts.blkmax, BUILD_BLKMAX},
+    { "pktmax", "max number of packets to send when placing blocks at once", &buildopts.pktmax, BUILD_PKTMAX},
     { "placemode", "behavior to activate placement: 0:don't 1:once 2:many", &buildopts.placemode, 1},
     { "wm", "wall mode - limit placement to blocks beneath player",     &buildopts.wallmode, 0},
     { "sm", "seal mode - limit placement to blocks in front of player", &buildopts.sealmode, 0},
     { "anyface", "place on any faces even if they look away from player",   &buildopts.anyface, 0},
     { "bjump", "build while jumping/falling/swimming",                  &buildopts.bjump, 0},
     { "preview_retain", "Retain preview when buildtask is canceled",    &buildopts.preview_retain, 0},
+    { "route", "place blocks along the planned route",                  &buildopts.route, 0},
     { NULL, NULL, NULL, 0 }, //list terminator
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
 static void build_update_placed();
+static void plan_route();
 
 ////////////////////////////////////////////////////////////////////////////////
 // Inventory
@@ -289,74 +341,365 @@ int prefetch_material(MCPacketQueue *sq, MCPacketQueue *cq, bid_t mat) {
     return -2; //material being fetched
 }
 
-static int build_info_compar(const void *a, const void *b) {
-    const build_info_material *ma = a;
-    const build_info_material *mb = b;
+////////////////////////////////////////////////////////////////////////////////
+// Material ledger
 
-    int a_needed = ma->total - ma->placed;
-    int b_needed = mb->total - mb->placed;
+// material counters of the buildtask or buildplan, updated as the blocks get
+// placed or the inventory changes instead of recounting everything on each
+// query. The materials are kept sorted by the number of blocks to place
+typedef struct {
+    lh_arr_declare(build_info_material,mat);
+    int32_t     idx[65536];     // index+1 in mat by the material raw value, 0 if not used
+    int         total, placed;
+    struct {
+        int16_t item, count, damage;
+    } inv[36];                  // inventory slots 9-44 as counted in the available amounts
+    uint32_t    rev;            // buildplan revision the plan counters are based on
+    int         stale;          // placed flags of the task need a resync from the world
+} mledger;
+
+static mledger tledger, pledger;
+
+#define NEEDED(m) ((m)->total-(m)->placed)
+
+#define TIDX_HASH(x,y,z) (((uint32_t)(x)*73856093U)^((uint32_t)(y)*83492791U)^((uint32_t)(z)*19349663U))
+
+static void ledger_swap(mledger *l, int a, int b) {
+    if (a == b) return;
+    build_info_material t = P(l->mat)[a];
+    P(l->mat)[a] = P(l->mat)[b];
+    P(l->mat)[b] = t;
+    l->idx[P(l->mat)[a].material.raw] = a+1;
+    l->idx[P(l->mat)[b].material.raw] = b+1;
+}
 
-    if (a_needed < b_needed) return 1;
-    if (a_needed > b_needed) return -1;
-    return 0;
+// account a block of the material being added to the task (dtotal) or
+// placed/removed (dplaced), changing the number to place by at most one.
+// This only requires swapping the material with the first or last one of
+// the equal count to keep the list sorted
+static void ledger_count(mledger *l, bid_t mat, int dtotal, int dplaced) {
+    int i = l->idx[mat.raw]-1;
+    if (i < 0) {
+        build_info_material *m = lh_arr_new_c(GAR(l->mat));
+        m->material = mat;
+        i = C(l->mat)-1;
+        l->idx[mat.raw] = i+1;
+
+        int j;
+        for(j=0; j<36; j++)
+            if (l->inv[j].item>=0 && l->inv[j].item<0x100 &&
+                BLOCKTYPE(l->inv[j].item, l->inv[j].damage).raw == mat.raw)
+                m->available += l->inv[j].count;
+    }
+
+    int need = NEEDED(P(l->mat)+i);
+    int lo, hi;
+    if (dtotal > dplaced) {
+        // move in front of the materials with the same count
+        lo=0; hi=i;
+        while (lo<hi) {
+            int mid = (lo+hi)/2;
+            if (NEEDED(P(l->mat)+mid) > need) lo=mid+1; else hi=mid;
+        }
+        ledger_swap(l, i, lo);
+        i = lo;
+    }
+    else if (dtotal < dplaced) {
+        // move behind the materials with the same count
+        lo=i; hi=C(l->mat)-1;
+        while (lo<hi) {
+            int mid = (lo+hi+1)/2;
+            if (NEEDED(P(l->mat)+mid) < need) hi=mid-1; else lo=mid;
+        }
+        ledger_swap(l, i, lo);
+        i = lo;
+    }
+
+    P(l->mat)[i].total  += dtotal;
+    P(l->mat)[i].placed += dplaced;
+    l->total  += dtotal;
+    l->placed += dplaced;
 }
 
-build_info * get_build_info(int plan) {
-    lh_create_obj(build_info, bi)
+static void ledger_reset(mledger *l) {
+    int i;
+    for(i=0; i<C(l->mat); i++)
+        l->idx[P(l->mat)[i].material.raw] = 0;
+    lh_arr_free(GAR(l->mat));
+    l->total = l->placed = 0;
+    l->rev = 0;
+    l->stale = 0;
+}
 
-    if (!plan) build_update_placed();
+// add or remove the contents of a ledger inventory slot to the available amounts
+static void ledger_slot(mledger *l, int i, int sign) {
+    if (l->inv[i].item<0 || l->inv[i].item>=0x100) return;
+    int k = l->idx[BLOCKTYPE(l->inv[i].item, l->inv[i].damage).raw]-1;
+    if (k >= 0) P(l->mat)[k].available += sign*l->inv[i].count;
+}
 
-    int total[65536], placed[65536], available[65536];
-    lh_clear_obj(total);
-    lh_clear_obj(placed);
-    lh_clear_obj(available);
+// apply the inventory slots that have changed since the last query
+static void ledger_inventory(mledger *l) {
+    int i;
+    for(i=0; i<36; i++) {
+        slot_t *s = &gs.inv.slots[i+9];
+        if (l->inv[i].item == s->item && l->inv[i].damage == s->damage &&
+            l->inv[i].count == s->count) continue;
 
-    // process build task or plan to calculate amounts of each material
-    int i,j;
-    if (plan) {
-        for (i=0; build.bp && i<C(build.bp->plan); i++) {
-            bid_t bmat = get_base_material(P(build.bp->plan)[i].b);
-            total[bmat.raw]++;
-            bi->total ++;
-        }
+        ledger_slot(l, i, -1);
+        l->inv[i].item   = s->item;
+        l->inv[i].count  = s->count;
+        l->inv[i].damage = s->damage;
+        ledger_slot(l, i, 1);
+    }
+}
+
+// the placed state of a buildtask block, as used in the material ledger
+static inline int is_placed(blk *b, bid_t bl) {
+    int smask = (ITEMS[b->b.bid].flags&I_STATE_MASK)^15;
+    return (bl.bid == b->b.bid && (bl.meta&smask)==(b->b.meta&smask) );
+}
+
+static inline void ledger_set_placed(blk *b, int placed) {
+    if (b->counted == placed) return;
+    b->counted = placed;
+    ledger_count(&tledger, get_base_material(b->b), 0, placed ? 1 : -1);
+}
+
+// buildtask index of the block at a position, -1 if there is none
+static int32_t task_at(int32_t x, int32_t y, int32_t z) {
+    if (!build.ntidx) return -1;
+
+    uint32_t h = TIDX_HASH(x,y,z)&(build.ntidx-1);
+    for(; build.tidx[h]; h=(h+1)&(build.ntidx-1)) {
+        blk *b = P(build.task)+build.tidx[h]-1;
+        if (b->x==x && b->y==y && b->z==z)
+            return build.tidx[h]-1;
+    }
+    return -1;
+}
+
+// true if there is something in the world at the block position or next to it
+// that can be used to place the block against
+static int has_support(blk *b) {
+    if (b->y<0 || b->y>255) return 0;
+    if (!ISEMPTY(get_block_at(b->x, b->z, b->y).bid)) return 1;
+
+    int f;
+    for(f=0; f<6; f++) {
+        int32_t y = b->y+NOFF[f][2];
+        if (y<0 || y>255) continue;
+        if (!ISEMPTY(get_block_at(b->x+NOFF[f][0], b->z+NOFF[f][1], y).bid)) return 1;
+    }
+    return 0;
+}
+
+// add or remove a buildtask block to/from the frontier according to its state
+static void frontier_update(int32_t i) {
+    blk *b = P(build.task)+i;
+    int in = !b->counted && has_support(b);
+    if (in == (b->fpos>0)) return;
+
+    if (in) {
+        *lh_arr_new(GAR(build.front)) = i;
+        b->fpos = C(build.front);
     }
     else {
-        for (i=0; i<C(build.task); i++) {
-            bid_t bmat = get_base_material(P(build.task)[i].b);
-            total[bmat.raw]++;
-            bi->total++;
-            if (P(build.task)[i].placed) {
-                placed[bmat.raw]++;
-                bi->placed ++;
-            }
+        // move the last frontier block into this one's place
+        int32_t last = P(build.front)[C(build.front)-1];
+        P(build.front)[b->fpos-1] = last;
+        P(build.task)[last].fpos = b->fpos;
+        C(build.front)--;
+        b->fpos = 0;
+    }
+}
+
+static int sort_chunk_order(const void *a, const void *b) {
+    blk *ba = P(build.task)+*(int32_t *)a;
+    blk *bb = P(build.task)+*(int32_t *)b;
+
+    if ((ba->x>>4) != (bb->x>>4)) return (ba->x>>4) < (bb->x>>4) ? -1 : 1;
+    if ((ba->z>>4) != (bb->z>>4)) return (ba->z>>4) < (bb->z>>4) ? -1 : 1;
+    return (ba < bb) ? -1 : (ba > bb);
+}
+
+// recount the buildtask materials and index its blocks by position and
+// by chunk - called when the buildtask was created or extended
+static void index_task() {
+    ledger_reset(&tledger);
+    lh_free(build.tidx);
+    lh_free(build.tord);
+    lh_arr_free(GAR(build.front));
+    lh_arr_free(GAR(build.route));
+    build.ntidx = 0;
+    if (!C(build.task)) return;
+
+    int32_t n = 64;
+    while (n < 2*C(build.task)) n<<=1;
+    lh_alloc_num(build.tidx, n);
+    build.ntidx = n;
+    lh_alloc_num(build.tord, C(build.task));
+
+    int i;
+    for(i=0; i<C(build.task); i++) {
+        blk *b = P(build.task)+i;
+        build.tord[i] = i;
+        b->counted = 0;
+        ledger_count(&tledger, get_base_material(b->b), 1, 0);
+
+        uint32_t h = TIDX_HASH(b->x,b->y,b->z)&(n-1);
+        while (build.tidx[h]) h=(h+1)&(n-1);
+        build.tidx[h] = i+1;
+    }
+    qsort(build.tord, C(build.task), sizeof(build.tord[0]), sort_chunk_order);
+    plan_route();
+
+    // dependency graph - link the neighbor blocks in the buildtask
+    for(i=0; i<C(build.task); i++) {
+        blk *b = P(build.task)+i;
+        int f;
+        for(f=0; f<6; f++)
+            b->tnb[f] = task_at(b->x+NOFF[f][0], b->y+NOFF[f][2], b->z+NOFF[f][1]);
+        b->fpos = 0;
+    }
+
+    // placed state of the new blocks is not known yet
+    tledger.stale = 1;
+}
+
+// interval after which a placement not answered by the server is considered
+// lost and the block may be placed again. Derived from the measured round-trip
+// time like a TCP retransmission timeout, and limited by blkint
+static int64_t retry_interval() {
+    if (!build.srtt) return buildopts.blkint;
+    int64_t rto = build.srtt+4*build.rttvar;
+    return MAX(BUILD_RTTMIN, MIN(rto, buildopts.blkint));
+}
+
+// the server has answered a placement with a block update - either confirmed
+// or rejected. Placements sent more than once give no valid RTT sample
+static void placement_answered(blk *b, int placed) {
+    if (!b->retried) {
+        int64_t rtt = MAX(1, (int64_t)(gettimestamp()-b->sent));
+        if (!build.srtt) {
+            build.srtt = rtt;
+            build.rttvar = rtt/2;
+        }
+        else {
+            build.rttvar += (llabs(build.srtt-rtt)-build.rttvar)/4;
+            build.srtt += (rtt-build.srtt)/8;
         }
     }
+    b->sent = 0;
+    b->retried = 0;
+    b->rejects = placed ? 0 : MIN(b->rejects+1, 8);
+}
 
-    // available materials in the inventory
-    for (i=9; i<45; i++) {
-        if (gs.inv.slots[i].item<0 || gs.inv.slots[i].item>=0x100) continue;
-        bid_t bmat = BLOCKTYPE(gs.inv.slots[i].item, gs.inv.slots[i].damage);
-        available[bmat.raw] += gs.inv.slots[i].count;
-        if (total[bmat.raw] > 0)
-            bi->available += gs.inv.slots[i].count;
+// a block in the world has changed - update the buildtask blocks at this position
+// and the frontier state of the neighbors it may support
+static void ledger_block_changed(int32_t x, int32_t y, int32_t z) {
+    if (!build.ntidx) return;
+
+    int f, found=0;
+    uint32_t h = TIDX_HASH(x,y,z)&(build.ntidx-1);
+    for(; build.tidx[h]; h=(h+1)&(build.ntidx-1)) {
+        int32_t i = build.tidx[h]-1;
+        blk *b = P(build.task)+i;
+        if (b->x!=x || b->y!=y || b->z!=z) continue;
+        int placed = is_placed(b, get_block_at(x,z,y));
+        if (b->sent) placement_answered(b, placed);
+        ledger_set_placed(b, placed);
+
+        frontier_update(i);
+        for(f=0; f<6; f++)
+            if (b->tnb[f] >= 0)
+                frontier_update(b->tnb[f]);
+        found = 1;
     }
 
-    // store all stats where more blocks need to be placed into build_info struct
-    for(i=0; i<65536; i++) {
-        if (total[i] - placed[i] > 0) {
-            build_info_material * m = lh_arr_new_c(GAR1(bi->mat));
-            m->material.raw = i;
-            m->total = total[i];
-            m->placed = placed[i];
-            m->available = available[i];
+    // a block outside of the buildtask may support the neighbors too
+    if (!found)
+        for(f=0; f<6; f++) {
+            int32_t j = task_at(x+NOFF[f][0], y+NOFF[f][2], z+NOFF[f][1]);
+            if (j >= 0) frontier_update(j);
+        }
+}
+
+// handler for the world updates from the server, called after the gamestate
+// has processed the packet
+static void ledger_packet(MCPacket *pkt) {
+    int i;
+    switch(pkt->pid) {
+        case SP_BlockChange: {
+            SP_BlockChange_pkt *tpkt = &pkt->_SP_BlockChange;
+            ledger_block_changed(tpkt->pos.x, tpkt->pos.y, tpkt->pos.z);
+            break;
+        }
+        case SP_MultiBlockChange: {
+            SP_MultiBlockChange_pkt *tpkt = &pkt->_SP_MultiBlockChange;
+            for(i=0; i<tpkt->count; i++) {
+                blkrec *br = tpkt->blocks+i;
+                ledger_block_changed(((tpkt->X)<<4)+br->x, br->y, ((tpkt->Z)<<4)+br->z);
+            }
+            break;
+        }
+        case SP_Explosion: {
+            SP_Explosion_pkt *tpkt = &pkt->_SP_Explosion;
+            for(i=0; i<tpkt->count; i++)
+                ledger_block_changed((int)(tpkt->x)+tpkt->blocks[i].dx,
+                                     (int)(tpkt->y)+tpkt->blocks[i].dy,
+                                     (int)(tpkt->z)+tpkt->blocks[i].dz);
+            break;
+        }
+        case SP_ChunkData: {
+            // a (re)loaded chunk in the build area - resync on the next query
+            SP_ChunkData_pkt *tpkt = &pkt->_SP_ChunkData;
+            if (tpkt->chunk.X >= build.xmin>>4 && tpkt->chunk.X <= build.xmax>>4 &&
+                tpkt->chunk.Z >= build.zmin>>4 && tpkt->chunk.Z <= build.zmax>>4)
+                tledger.stale = 1;
+            break;
         }
     }
+}
+
+// buildplan counters, recounted only when the buildplan was modified
+static mledger * ledger_plan() {
+    mledger *l = &pledger;
+    if (build.bp && build.bp->rev && build.bp->rev == l->rev) return l;
+
+    ledger_reset(l);
+    int i;
+    for (i=0; build.bp && i<C(build.bp->plan); i++)
+        ledger_count(l, get_base_material(P(build.bp->plan)[i].b), 1, 0);
+    if (build.bp) l->rev = build.bp->rev;
+    return l;
+}
 
-    // other info
-    bi->limit = build.limit;
+build_info * get_build_info(int plan) {
+    lh_create_obj(build_info, bi)
+
+    mledger *l = &tledger;
+    if (plan)
+        l = ledger_plan();
+    else if (tledger.stale)
+        build_update_placed();
+
+    ledger_inventory(l);
+
+    // materials with blocks still to place are at the start of the list
+    int i, n=0;
+    for(i=0; i<C(l->mat); i++) {
+        if (NEEDED(P(l->mat)+i) > 0) n++;
+        bi->available += P(l->mat)[i].available;
+    }
+    if (n > 0) {
+        lh_arr_allocate_c(GAR1(bi->mat), n);
+        memmove(P(bi->mat), P(l->mat), n*sizeof(P(bi->mat)[0]));
+    }
 
-    // sort by number of blocks to be placed
-    qsort(P(bi->mat), C(bi->mat), sizeof(P(bi->mat)[0]), build_info_compar);
+    bi->total  = l->total;
+    bi->placed = l->placed;
+    bi->limit  = build.limit;
 
     return bi;
 }
@@ -417,17 +760,121 @@ static dotpos_t DOTPOS[6] = {
     [DIR_WEST]  = { 32, 2, 2,  0,2,0,  0,0,2, }, // Z-Y
 };
 
+// horizontal look sectors for the blocks requiring a certain placement direction,
+// approximating the directions returned by calculate_yaw_pitch: a dot is in the
+// sector if |p| < tan(45-YAWMARGIN)*a, where a is the dot offset along the sector
+// direction and p the offset across it. Only dots within rounding distance of the
+// sector boundary may get classified differently than by calculate_yaw_pitch
+static struct {
+    double ax,az;   // sector direction
+    double px,pz;   // perpendicular
+} SECTOR[6] = {
+    [DIR_SOUTH] = {  0, 1,  1, 0 },
+    [DIR_NORTH] = {  0,-1,  1, 0 },
+    [DIR_EAST]  = {  1, 0,  0, 1 },
+    [DIR_WEST]  = { -1, 0,  0, 1 },
+};
+static double yawtan = 0;
+
+// test a row of 15 dots against the reach sphere and the required look direction.
+// Dot i is at (rx,ry,rz)+i*(cx,cy,cz), the eyes at (ex,ey,ez). The dot offsets
+// and distances are computed in the same order as the per-dot evaluation did,
+// so the reach test gives the identical results. Returns the mask of the
+// passing dots and raises *maxdist to their largest distance.
+// On x86-64 two dots are processed at once with SSE2
+static inline uint16_t row_reach(uint16_t drow, int rdir,
+                                 double rx, double ry, double rz,
+                                 double cx, double cy, double cz,
+                                 double ex, double ey, double ez, double *maxdist) {
+    uint16_t mask = 0;
+    drow &= 0x7fff;
+    int i;
+
+#ifdef __SSE2__
+    __m128d vrx = _mm_set1_pd(rx), vcx = _mm_set1_pd(cx), vex = _mm_set1_pd(ex);
+    __m128d vry = _mm_set1_pd(ry), vcy = _mm_set1_pd(cy), vey = _mm_set1_pd(ey);
+    __m128d vrz = _mm_set1_pd(rz), vcz = _mm_set1_pd(cz), vez = _mm_set1_pd(ez);
+    __m128d reach = _mm_set1_pd(MAXREACH);
+    __m128d zero  = _mm_setzero_pd();
+    __m128d sign  = _mm_set1_pd(-0.0);
+    __m128d m     = _mm_set1_pd(*maxdist);
+    __m128d idx   = _mm_set_pd(1,0);
+    __m128d two   = _mm_set1_pd(2);
+
+    __m128d ax=zero, az=zero, px=zero, pz=zero, t=zero;
+    if (rdir >= 0) {
+        ax = _mm_set1_pd(SECTOR[rdir].ax);
+        az = _mm_set1_pd(SECTOR[rdir].az);
+        px = _mm_set1_pd(SECTOR[rdir].px);
+        pz = _mm_set1_pd(SECTOR[rdir].pz);
+        t  = _mm_set1_pd(yawtan);
+    }
+
+    for(i=0; i<16; i+=2, idx=_mm_add_pd(idx,two)) {
+        if (!((drow>>i)&3)) continue;
+
+        __m128d dx = _mm_sub_pd(_mm_add_pd(vrx, _mm_mul_pd(vcx,idx)), vex);
+        __m128d dy = _mm_sub_pd(_mm_add_pd(vry, _mm_mul_pd(vcy,idx)), vey);
+        __m128d dz = _mm_sub_pd(_mm_add_pd(vrz, _mm_mul_pd(vcz,idx)), vez);
+        __m128d d  = _mm_sqrt_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(dx,dx),
+                                                       _mm_mul_pd(dz,dz)),
+                                            _mm_mul_pd(dy,dy)));
+        __m128d ok = _mm_cmple_pd(d, reach);
+
+        if (rdir >= 0) {
+            __m128d a = _mm_add_pd(_mm_mul_pd(ax,dx), _mm_mul_pd(az,dz));
+            __m128d p = _mm_add_pd(_mm_mul_pd(px,dx), _mm_mul_pd(pz,dz));
+            __m128d in = _mm_cmplt_pd(_mm_andnot_pd(sign,p), _mm_mul_pd(t,a));
+            // a dot straight above or below counts as south, as in calculate_yaw_pitch
+            if (rdir == DIR_SOUTH)
+                in = _mm_or_pd(in, _mm_and_pd(_mm_cmpeq_pd(dx,zero), _mm_cmpeq_pd(dz,zero)));
+            ok = _mm_and_pd(ok, in);
+        }
+
+        // keep only the enabled dots
+        ok = _mm_and_pd(ok, _mm_castsi128_pd(_mm_set_epi32(-((drow>>(i+1))&1), -((drow>>(i+1))&1),
+                                                           -((drow>>i)&1), -((drow>>i)&1))));
+        mask |= _mm_movemask_pd(ok)<<i;
+        m = _mm_max_pd(m, _mm_and_pd(ok,d));
+    }
+
+    *maxdist = _mm_cvtsd_f64(_mm_max_sd(m, _mm_unpackhi_pd(m,m)));
+#else
+    for(i=0; i<15; i++) {
+        if (!((drow>>i)&1)) continue;
+
+        double dx = (rx+cx*i)-ex, dy = (ry+cy*i)-ey, dz = (rz+cz*i)-ez;
+        double d = sqrt(dx*dx+dz*dz+dy*dy);
+        if (d > MAXREACH) continue;
+
+        if (rdir >= 0) {
+            double a = SECTOR[rdir].ax*dx + SECTOR[rdir].az*dz;
+            double p = SECTOR[rdir].px*dx + SECTOR[rdir].pz*dz;
+            // a dot straight above or below counts as south, as in calculate_yaw_pitch
+            if (!(fabs(p) < yawtan*a || (rdir == DIR_SOUTH && dx == 0 && dz == 0)))
+                continue;
+        }
+
+        mask |= 1<<i;
+        if (d > *maxdist) *maxdist = d;
+    }
+#endif
+
+    return mask;
+}
+
 // from all the dots which can be used to place a block correctly,
 // remove those out of player's reach by updating the dot masks
 static void remove_distant_dots(blk *b) {
-    // reset distance to the block
-    // this will be now replaced with the max dot distance
-    b->dist = 0;
+    if (!yawtan) yawtan = tan((45-YAWMARGIN)/180*M_PI);
 
     double px = gs.own.x;
     double pz = gs.own.z;
     double py = gs.own.y+EYEHEIGHT;
 
+    // the block distance is replaced with the max dot distance
+    double maxdist = 0;
+
     int f;
     for(f=0; f<6; f++) {
         if (!((b->neigh>>f)&1) && !b->needadj) continue; // no neighbor - skip this face
@@ -439,64 +886,25 @@ static void remove_distant_dots(blk *b) {
         double nz = (b->z+NOFF[f][1]);
         double ny = (b->y+NOFF[f][2]);
 
-        int dr,dc;
+        int dr;
         for(dr=0; dr<15; dr++) {
-            uint16_t drow = dots[dr];
-            if (!drow) continue; // skip disabled rows
+            if (!dots[dr]) continue; // skip disabled rows
 
             // dot dr,0 coordinates in 3D space
             double rx = nx + dotpos.x/32 + dotpos.rx*dr/32;
             double ry = ny + dotpos.y/32 + dotpos.ry*dr/32;
             double rz = nz + dotpos.z/32 + dotpos.rz*dr/32;
 
-            for(dc=0; dc<15; dc++) {
-                uint16_t mask = 1<<dc;
-                if (!(drow&mask)) continue; // skip disabled dots
-
-                double x = rx + dotpos.cx*dc/32;
-                double y = ry + dotpos.cy*dc/32;
-                double z = rz + dotpos.cz*dc/32;
-
-                double dist = sqrt(SQ(x-px)+SQ(z-pz)+SQ(y-py));
-
-                if (dist > MAXREACH) {
-                    dots[dr] &= ~mask; // this dot is too far away - disable it
-                    drow = dots[dr];
-                    continue;
-                }
-
-                if (b->rdir != DIR_ANY) {
-                    // this block requires a certain player look direction on placement
-                    double yaw,pitch;
-                    int yawdir = calculate_yaw_pitch(x, z, y, &yaw, &pitch);
-                    if (yawdir != b->rdir) {
-                        // direction does not match - we can't place this block
-                        // as needed from player's perspective
-                        dots[dr] &= ~mask;
-                        drow = dots[dr];
-                        continue;
-                    }
-                }
-
-                // update block distance - necessary for the decision
-                // which block to place first
-                if (b->dist < dist)
-                    b->dist = dist;
-            }
+            dots[dr] = row_reach(dots[dr], b->rdir, rx, ry, rz,
+                                 dotpos.cx/32, dotpos.cy/32, dotpos.cz/32,
+                                 px, py, pz, &maxdist);
         }
     }
 
+    b->dist = maxdist;
     b->inreach = (b->dist > 0);
 }
 
-// cound how many active dots are in a row
-static inline int count_dots_row(uint16_t dots) {
-    int i,c=0;
-    for (i=0; i<15; dots>>=1,i++)
-        c += (dots&1);
-    return c;
-}
-
 // count how many active dots are on all faces of the block
 static inline int count_dots(blk *b) {
     int f;
@@ -504,7 +912,7 @@ static inline int count_dots(blk *b) {
     for(f=0; f<6; f++) {
         int dr;
         for(dr=0; dr<15; dr++) {
-            c += count_dots_row(b->dots[f][dr]);
+            c += __builtin_popcount(b->dots[f][dr]);
         }
     }
 
@@ -522,6 +930,114 @@ static int sort_blocks(const void *a, const void *b) {
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Route planning
+
+// width of the strips the route sweeps
+#define ROUTE_STRIP 4
+
+// predicate function to sort the blocks by their position on the route
+static int sort_route(const void *a, const void *b) {
+    int64_t ra = P(build.task)[*((int *)a)].route;
+    int64_t rb = P(build.task)[*((int *)b)].route;
+    return (ra < rb) ? -1 : (ra > rb);
+}
+
+// plan a route over the buildtask - it is swept layer by layer, and each layer
+// in strips of ROUTE_STRIP blocks along its longer horizontal side. The direction
+// alternates, so every strip starts where the previous one ended. The route is
+// only a suggested order, placing a block still requires a neighbor to be there,
+// and working upwards layer by layer ensures the supports come first
+static void plan_route() {
+    lh_arr_free(GAR(build.route));
+    if (!C(build.task)) return;
+
+    // sweep along x if the buildtask is longer in x
+    int alongx = (build.xmax-build.xmin >= build.zmax-build.zmin);
+    int32_t amin = alongx ? build.xmin : build.zmin;
+    int32_t alen = (alongx ? build.xmax : build.zmax) - amin + 1;
+    int32_t cmin = alongx ? build.zmin : build.xmin;
+    int32_t nstrips = ((alongx ? build.zmax : build.xmax) - cmin)/ROUTE_STRIP + 1;
+
+    int i;
+    for(i=0; i<C(build.task); i++) {
+        blk *b = P(build.task)+i;
+        int32_t a = (alongx ? b->x : b->z) - amin;
+        int32_t c = (alongx ? b->z : b->x) - cmin;
+        int32_t l = b->y - build.ymin;
+
+        // strip number on the route - the strips of odd layers are swept backwards
+        int32_t s = c/ROUTE_STRIP;
+        if (l&1) s = nstrips-1-s;
+        int64_t g = (int64_t)l*nstrips+s;
+
+        // serpentine along the strips, and across the strip in each column,
+        // starting on the side of the previous strip
+        if (g&1) a = alen-1-a;
+        c %= ROUTE_STRIP;
+        if ((a^l)&1) c = ROUTE_STRIP-1-c;
+
+        b->route = (g*alen+a)*ROUTE_STRIP+c;
+    }
+
+    // waypoints at the first and last block of every strip on the route
+    int *order;
+    lh_alloc_num(order, C(build.task));
+    for(i=0; i<C(build.task); i++) order[i] = i;
+    qsort(order, C(build.task), sizeof(order[0]), sort_route);
+
+    int64_t slen = (int64_t)alen*ROUTE_STRIP;
+    rstrip *rs = NULL;
+    for(i=0; i<C(build.task); i++) {
+        blk *b = P(build.task)+order[i];
+        if (!rs || rs->rmax/slen != b->route/slen) {
+            rs = lh_arr_new(GAR(build.route));
+            rs->start = (off3_t) { b->x, b->y, b->z };
+            rs->rmin = b->route;
+        }
+        rs->end = (off3_t) { b->x, b->y, b->z };
+        rs->rmax = b->route;
+    }
+    lh_free(order);
+}
+
+// print the route waypoints, starting with the strip of the first block
+// that is not placed yet
+static void print_route(char *reply) {
+    if (!C(build.task)) {
+        sprintf(reply, "You need an existing buildtask to plan a route");
+        return;
+    }
+    if (tledger.stale) build_update_placed();
+
+    // first unplaced block on the route
+    int i, next=-1;
+    for(i=0; i<C(build.task); i++) {
+        blk *b = P(build.task)+i;
+        if (!b->counted && (next<0 || b->route < P(build.task)[next].route))
+            next = i;
+    }
+    if (next<0) {
+        sprintf(reply, "All blocks of the buildtask are placed");
+        return;
+    }
+
+    blk *nb = P(build.task)+next;
+    for(i=0; i<C(build.route) && P(build.route)[i].rmax < nb->route; i++);
+
+    char *r = reply;
+    r += sprintf(r, "Route: strip %d of %zd, next block at %d,%d,%d. Waypoints:",
+                 i+1, C(build.route), nb->x, nb->y, nb->z);
+    int n;
+    for(n=0; i<C(build.route) && n<3; i++,n++) {
+        rstrip *rs = P(build.route)+i;
+        r += sprintf(r, " %d,%d,%d-%d,%d,%d", rs->start.x, rs->start.y, rs->start.z,
+                     rs->end.x, rs->end.y, rs->end.z);
+    }
+    if (i<C(build.route))
+        sprintf(r, " ...");
+}
+
 // set all dot faces on the block
 static inline void setdots(blk *b, uint16_t *u, uint16_t *d,
                            uint16_t *s, uint16_t *n, uint16_t *e, uint16_t *w) {
@@ -538,22 +1054,31 @@ static inline void setdots(blk *b, uint16_t *u, uint16_t *d,
 static void build_update_placed() {
     if (C(build.task)<=0) return;
 
-    extent_t ex = { { build.xmin, build.ymin, build.zmin },
-                    { build.xmax, build.ymax, build.zmax } };
-    cuboid_t c = export_cuboid_extent(ex);
+    // visit the blocks chunk by chunk, so every chunk is looked up only once
+    int i=0;
+    while (i<C(build.task)) {
+        blk *b = P(build.task)+build.tord[i];
+        int32_t X = b->x>>4, Z = b->z>>4;
+        gschunk *gc = find_chunk(gs.world, X, Z, 0);
 
-    int i;
-    for(i=0; i<C(build.task); i++) {
-        blk *b = P(build.task)+i;
-        bid_t *slice = c.data[b->y-build.ymin]+c.boff;
-        bid_t *row = slice+(b->z-build.zmin)*c.sa.x;
-        bid_t bl = row[b->x-build.xmin];
-        int smask = (ITEMS[b->b.bid].flags&I_STATE_MASK)^15;
-        b->placed = (bl.bid == b->b.bid && (bl.meta&smask)==(b->b.meta&smask) );
-        b->empty  = ISEMPTY(bl.bid) && !b->placed;
-        b->current = bl;
+        for(; i<C(build.task); i++) {
+            b = P(build.task)+build.tord[i];
+            if ((b->x>>4) != X || (b->z>>4) != Z) break;
+
+            // blocks in the chunks not loaded are considered air
+            bid_t bl = BLOCKTYPE(0,0);
+            if (gc && b->y>=0 && b->y<256)
+                bl = gc->blocks[(b->y<<8)|((b->z&15)<<4)|(b->x&15)];
+            b->placed = is_placed(b, bl);
+            b->empty  = ISEMPTY(bl.bid) && !b->placed;
+            b->current = bl;
+            ledger_set_placed(b, b->placed);
+        }
     }
-    free_cuboid(c);
+    tledger.stale = 0;
+
+    for(i=0; i<C(build.task); i++)
+        frontier_update(i);
 }
 
 #define PLACE_EAST(b)  setdots(b, DOTS_NONE, DOTS_NONE, DOTS_NONE, DOTS_NONE, DOTS_NONE, DOTS_ALL);
@@ -565,7 +1090,9 @@ static void build_update_placed() {
 #define PLACE_NONE(b)  setdots(b, DOTS_NONE, DOTS_NONE, DOTS_NONE, DOTS_NONE, DOTS_NONE, DOTS_NONE);
 #define PLACE_ALL(b)   setdots(b, DOTS_ALL, DOTS_ALL, DOTS_ALL, DOTS_ALL, DOTS_ALL, DOTS_ALL);
 
-void set_block_dots(blk *b) {
+// placement rules - determine the usable dots on the neighbor faces
+// and the required look direction for the block type
+static void block_dots_rules(blk *b) {
     // determine usable dots on the neighbor faces
     lh_clear_obj(b->dots);
 
@@ -898,13 +1425,79 @@ void set_block_dots(blk *b) {
             memset(b->dots[f], 0, sizeof(DOTS_ALL));
 }
 
+// placement rules table for the blocks 0-255 by the raw block type value,
+// generated from block_dots_rules. Each entry holds the dot pattern of every
+// face (DOTRULE_FACE), the required look direction+1 (0 if any) and a flag
+// for the blocks whose rules depend on the player position or on the
+// neighbor blocks, which are then evaluated with block_dots_rules
+#define DOTRULE_FACE(r,f)   (((r)>>(2*(f)))&3)
+#define DOTRULE_RDIR(r)     ((((r)>>12)&7)-1)
+#define DOTRULE_DYN         0x8000
+
+static uint16_t DOTRULES[4096];
+static int dotrules_init = 0;
+
+// face dot patterns, as indexed by DOTRULE_FACE
+static uint16_t *DOTPAT[4] = { DOTS_NONE, DOTS_ALL, DOTS_LOWER, DOTS_UPPER };
+
+static void generate_dotrules() {
+    int i,f,p;
+    for(i=0; i<4096; i++) {
+        blk t;
+        lh_clear_obj(t);
+        t.b.raw = i;
+        t.neigh = 0x3f;
+        t.rdir  = DIR_ANY;
+
+        if (ITEMS[t.b.bid].flags&(I_RSDEV|I_OBSERVER|I_PLANT)) {
+            DOTRULES[i] = DOTRULE_DYN;
+            continue;
+        }
+
+        block_dots_rules(&t);
+
+        uint16_t r = ((t.rdir+1)&7)<<12;
+        for(f=0; f<6; f++) {
+            for(p=0; p<4; p++)
+                if (!memcmp(t.dots[f], DOTPAT[p], sizeof(DOTS_ALL))) break;
+            if (p == 4) {
+                // not a standard pattern - evaluate the rules for every block
+                r = DOTRULE_DYN;
+                break;
+            }
+            r |= p<<(2*f);
+        }
+        DOTRULES[i] = r;
+    }
+    dotrules_init = 1;
+}
+
+void set_block_dots(blk *b) {
+    if (!dotrules_init) generate_dotrules();
+
+    uint16_t r = (b->b.raw < 4096) ? DOTRULES[b->b.raw] : DOTRULE_DYN;
+    if (r&DOTRULE_DYN) {
+        block_dots_rules(b);
+        return;
+    }
+
+    // copy the face patterns, faces without a neighbor get no dots
+    int f;
+    for (f=0; f<6; f++)
+        memcpy(b->dots[f], ((b->neigh>>f)&1) ? DOTPAT[DOTRULE_FACE(r,f)] : DOTS_NONE,
+               sizeof(DOTS_ALL));
+
+    if (DOTRULE_RDIR(r) != DIR_ANY)
+        b->rdir = DOTRULE_RDIR(r);
+}
+
 // update inreach flag for the blocks - calculate which
-// blocks of the buildtask reachable (coarse estimation)
+// blocks of the build frontier reachable (coarse estimation)
 int update_inreach() {
     int i, num_inreach=0;
 
-    for(i=0; i<C(build.task); i++) {
-        blk *b = P(build.task)+i;
+    for(i=0; i<C(build.front); i++) {
+        blk *b = P(build.task)+P(build.front)[i];
         b->state = 0; // clear flags
         b->inreach = 1;
 
@@ -933,15 +1526,15 @@ int update_inreach() {
     return num_inreach;
 }
 
-// update placed and avail flags for the blocks in the buildtask, and
+// update placed and avail flags for the blocks in the build frontier, and
 // the neighbor mask
 int update_placed() {
     int i, num_avail=0;
 
     // determine which blocks are occupied and which neighbors are available
     build.nbq = 0;
-    for(i=0; i<C(build.task); i++) {
-        blk *b = P(build.task)+i;
+    for(i=0; i<C(build.front); i++) {
+        blk *b = P(build.task)+P(build.front)[i];
         b->placed  = 0;
         b->needadj = 0;
         b->empty   = 0;
@@ -1027,8 +1620,8 @@ void update_seal() {
     int num_empty=0;
 
     // determine limits for blocks in btask that still need placing
-    for(i=0; i<C(build.task); i++) {
-        blk *b = P(build.task)+i;
+    for(i=0; i<C(build.front); i++) {
+        blk *b = P(build.task)+P(build.front)[i];
 
         if (b->empty) {
             if (b->x<minx || !num_empty) minx=b->x;
@@ -1043,8 +1636,8 @@ void update_seal() {
 
     // depending on pivot direction, mark only blocks on certain side of
     // btask as suitable for seal mode
-    for(i=0; i<C(build.task); i++) {
-        blk *b = P(build.task)+i;
+    for(i=0; i<C(build.front); i++) {
+        blk *b = P(build.task)+P(build.front)[i];
         if (!b->empty) continue;
 
         switch (build.pv.dir) {
@@ -1058,8 +1651,8 @@ void update_seal() {
 
 void update_dots() {
     int i;
-    for(i=0; i<C(build.task); i++) {
-        blk *b = P(build.task)+i;
+    for(i=0; i<C(build.front); i++) {
+        blk *b = P(build.task)+P(build.front)[i];
         b->rdir = DIR_ANY;
 
         if (b->needadj) {
@@ -1119,6 +1712,11 @@ void update_boundary() {
     }
     //printf("Buildtask boundary: X: %d - %d   Z: %d - %d   Y: %d - %d\n",
     //       build.xmin, build.xmax, build.zmin, build.zmax, build.ymin, build.ymax);
+
+    // keep the chunks of the build area in memory
+    extent_t ex = { { build.xmin, build.ymin, build.zmin },
+                    { build.xmax, build.ymax, build.zmax } };
+    gs_pin_extent(&ex);
 }
 
 // called when player position or look have changed - update our placeable blocks list
@@ -1127,6 +1725,10 @@ void build_update() {
 
     int i,f;
 
+    // only the blocks in the frontier are considered for placement - the others
+    // are either placed or have nothing to be placed against yet
+    if (tledger.stale) build_update_placed();
+
     if (!update_inreach() || !update_placed() ) {
         // no potentially buildable blocks nearby - don't bother with the rest
         build.nbq = 0;
@@ -1138,18 +1740,18 @@ void build_update() {
     update_dots();
 
     build.nbq = 0;
-    for(i=0; i<C(build.task); i++) {
-        blk *b = P(build.task)+i;
+    for(i=0; i<C(build.front); i++) {
+        blk *b = P(build.task)+P(build.front)[i];
         if (!b->empty) continue;
 
         remove_distant_dots(b);
         b->ndots = count_dots(b);
         if (b->ndots>0 && build.nbq<MAXBUILDABLE)
-            build.bq[build.nbq++] = i;
+            build.bq[build.nbq++] = P(build.front)[i];
     }
     build.bq[build.nbq] = -1;
 
-    qsort(build.bq, build.nbq, sizeof(build.bq[0]), sort_blocks);
+    qsort(build.bq, build.nbq, sizeof(build.bq[0]), buildopts.route ? sort_route : sort_blocks);
 
     //TODO: calculate obstruction
     //TODO: allow less restricted placement rules through option
@@ -1191,7 +1793,28 @@ static int choose_dot(blk *b, int8_t *face, int8_t *cx, int8_t *cy, int8_t *cz)
     return 0;
 }
 
+// candidate block for placement in the current build_progress call
+typedef struct {
+    int     bi;         // index in the buildtask
+    int     qpos;       // position in the buildqueue
+    int     islot;      // quickbar slot with the material
+    int     run;        // order of the material in the batch
+} bcand;
+
+static int sort_bcand(const void *a, const void *b) {
+    const bcand *ca = a;
+    const bcand *cb = b;
+
+    // group by material, otherwise keep the buildqueue order (by distance or by route)
+    if (ca->run != cb->run) return ca->run < cb->run ? -1 : 1;
+    return (ca->qpos < cb->qpos) ? -1 : (ca->qpos > cb->qpos);
+}
+
 // asynchronous building method - check the buildqueue and try to build up to maxbld blocks
+//
+// The blocks to place in one call are grouped by material, so the held slot
+// is switched once per material, and the look is restored only once at the end. The number of packets sent to the server is limited
+// by the pktmax option
 void build_progress(MCPacketQueue *sq, MCPacketQueue *cq) {
     // time update - try to build any blocks from the placeable blocks list
     if (!build.active) return;
@@ -1203,15 +1826,22 @@ void build_progress(MCPacketQueue *sq, MCPacketQueue *cq) {
 
     if (ts < build.lastbuild+buildopts.bldint) return;
 
-    int i, bc=0;
+    int i, j, bc=0;
     int held=gs.inv.held;
 
-    for(i=0; i<build.nbq && bc<buildopts.blkmax; i++) {
-        char buf[4096];
-        char buf2[4096];
+    // select the candidate blocks
+    bcand cand[MAXBUILDABLE];
+    int ncand=0, nrun=0;
+    int uses[9];                // blocks to place from each quickbar slot
+    lh_clear_obj(uses);
 
+    for(i=0; i<build.nbq && ncand<buildopts.blkmax; i++) {
         blk *b = P(build.task)+build.bq[i];
-        if (ts-b->last < buildopts.blkint) continue;
+
+        // wait for the server to answer the last placement of this block,
+        // and back off further each time the server rejected it, up to blkint
+        int64_t wait = MIN(retry_interval()<<b->rejects, buildopts.blkint);
+        if (ts-b->last < wait) continue;
 
         // fetch block's material into quickbar slot
         int islot = prefetch_material(sq, cq, get_base_material(b->b));
@@ -1219,8 +1849,39 @@ void build_progress(MCPacketQueue *sq, MCPacketQueue *cq) {
         if (islot==-2) return; // inventory action is in progress, postpone building
         //TODO: notify user about missing materials
 
-        // silently switch to this slot
-        gmi_change_held(sq, cq, islot, 0);
+        // do not plan more blocks than there are items in the slot
+        if (uses[islot] >= gs.inv.slots[islot+36].count) continue;
+        uses[islot]++;
+
+        // keep the slot from being evicted by the next prefetch
+        mat_last[islot] = ts;
+
+        bcand *c = cand+ncand++;
+        c->bi = build.bq[i];
+        c->qpos = i;
+        c->islot = islot;
+        c->run = nrun;
+        for(j=0; j<ncand-1; j++)
+            if (cand[j].islot == islot) {
+                c->run = cand[j].run;
+                break;
+            }
+        if (c->run == nrun) nrun++;
+    }
+
+    qsort(cand, ncand, sizeof(cand[0]), sort_bcand);
+
+    // packets sent to the server, reserving two for the final restore
+    // of the look direction and the held slot
+    int npkt = 2;
+    int looked = 0;
+
+    for(i=0; i<ncand; i++) {
+        char buf[4096];
+        char buf2[4096];
+
+        blk *b = P(build.task)+cand[i].bi;
+        int islot = cand[i].islot;
         slot_t * hslot = &gs.inv.slots[islot+36];
 
         int8_t face, cx, cy, cz;
@@ -1261,6 +1922,16 @@ void build_progress(MCPacketQueue *sq, MCPacketQueue *cq) {
 #endif
         }
 
+        // stay within the packet budget - the switch of the held slot, look,
+        // placement and arm animation, and crouching if needed
+        int n = (islot != gs.inv.held) + 3 + 2*needcrouch;
+        if (bc>0 && npkt+n > buildopts.pktmax) break;
+        npkt += n;
+
+        // silently switch to this slot
+        if (islot != gs.inv.held)
+            gmi_change_held(sq, cq, islot, 0);
+
         // crouch if we have to place block on a block that reacts to right-click
         if (needcrouch) {
             NEWPACKET(CP_EntityAction, crouch);
@@ -1270,12 +1941,14 @@ void build_progress(MCPacketQueue *sq, MCPacketQueue *cq) {
             queue_packet(crouch,sq);
         }
 
-        // turn player look to the dot
+        // turn player look to the dot - every block gets its own dot, so
+        // there is a look packet for each placement
         NEWPACKET(CP_PlayerLook, pl);
         tpl->yaw = yaw;
         tpl->pitch = pitch;
         tpl->onground = gs.own.onground;
         queue_packet(pl,sq);
+        looked = 1;
 
         // place block
         NEWPACKET(CP_PlayerBlockPlacement, pbp);
@@ -1354,17 +2027,21 @@ void build_progress(MCPacketQueue *sq, MCPacketQueue *cq) {
             queue_packet(uncrouch,sq);
         }
 
-        // restore the former look direction
+        b->last = ts;
+        if (b->sent) b->retried = 1;
+        b->sent = ts;
+        build.lastbuild = ts;
+        mat_last[islot] = ts;
+        bc++;
+    }
+
+    // restore the former look direction
+    if (looked) {
         NEWPACKET(CP_PlayerLook, pl2);
         tpl2->yaw = gs.own.yaw;
         tpl2->pitch = gs.own.pitch;
         tpl2->onground = gs.own.onground;
         queue_packet(pl2,sq);
-
-        b->last = ts;
-        build.lastbuild = ts;
-        mat_last[islot] = ts;
-        bc++;
     }
 
     // switch back to whatever the client was holding
@@ -1429,6 +2106,7 @@ int build_tload(const char *name) {
     lh_free(buf);
 
     update_boundary();
+    index_task();
     build_update_placed();
 
     return 1;
@@ -1472,6 +2150,7 @@ void place_pivot(pivot_t pv, MCPacketQueue *sq, MCPacketQueue *cq) {
         // store the coordinates and direction so they can be reused for 'place again'
         build.pv = pv;
         update_boundary();
+        index_task();
         build_update();
         build_tsave(DEFAULT_TASK_FILENAME);
     }
@@ -1526,16 +2205,92 @@ void build_placemode(MCPacket *pkt, MCPacketQueue *sq, MCPacketQueue *cq) {
 ////////////////////////////////////////////////////////////////////////////////
 // Build Recorder
 
+// placements the server did not answer within this time (us) are dropped
+#define BREC_EXPIRE 5000000
+
+// hash slot of a pending block position - either the slot holding it
+// or the empty slot where it would be inserted
+static int32_t * brp_slot(int32_t x, int32_t y, int32_t z) {
+    uint32_t m = build.nbrpidx-1;
+    uint32_t h = TIDX_HASH(x,y,z)&m;
+    for(; build.brpidx[h]; h=(h+1)&m) {
+        blkr *bl = &P(build.brp)[build.brpidx[h]-1].b;
+        if (bl->x==x && bl->y==y && bl->z==z) break;
+    }
+    return build.brpidx+h;
+}
+
+// clear a hash slot and move up the following entries of the probe sequence,
+// so the lookups need no tombstones
+static void brp_unhash(int32_t *slot) {
+    uint32_t m = build.nbrpidx-1;
+    uint32_t i = slot-build.brpidx, j;
+    build.brpidx[i] = 0;
+    for(j=(i+1)&m; build.brpidx[j]; j=(j+1)&m) {
+        blkr *bl = &P(build.brp)[build.brpidx[j]-1].b;
+        uint32_t h = TIDX_HASH(bl->x,bl->y,bl->z)&m;
+        // the entry can take the free slot unless its home slot lies between the two
+        if (((j-h)&m) >= ((j-i)&m)) {
+            build.brpidx[i] = build.brpidx[j];
+            build.brpidx[j] = 0;
+            i = j;
+        }
+    }
+}
+
+// drop the entries no longer pending from the queue and rebuild the hash
+// with enough room for new entries
+static void brp_rehash() {
+    ssize_t i, n=0;
+    for(i=build.brphead; i<C(build.brp); i++)
+        if (P(build.brp)[i].ts)
+            P(build.brp)[n++] = P(build.brp)[i];
+    C(build.brp) = n;
+    build.brphead = 0;
+
+    lh_free(build.brpidx);
+    int32_t hn = 64;
+    while (hn < 4*n) hn<<=1;
+    lh_alloc_num(build.brpidx, hn);
+    build.nbrpidx = hn;
+
+    for(i=0; i<n; i++) {
+        blkr *bl = &P(build.brp)[i].b;
+        *brp_slot(bl->x,bl->y,bl->z) = i+1;
+    }
+}
+
+static void brp_clear() {
+    lh_arr_free(GAR(build.brp));
+    lh_free(build.brpidx);
+    build.nbrpidx = 0;
+    build.brphead = 0;
+}
+
+// drop the oldest placements that were not answered in time
+static void brp_expire(int64_t ts) {
+    char buf[256];
+    while (build.brphead < C(build.brp)) {
+        brpend *bp = P(build.brp)+build.brphead;
+        if (bp->ts) {
+            if (ts-bp->ts < BREC_EXPIRE) break;
+            printf("BREC: no update from the server for block %d,%d,%d (%s), dropped\n",
+                   bp->b.x, bp->b.y, bp->b.z, get_bid_name(buf, bp->b.b));
+            brp_unhash(brp_slot(bp->b.x,bp->b.y,bp->b.z));
+        }
+        build.brphead++;
+    }
+}
+
 // dump BREC blocks that are pending block update from the server
 static void dump_brec_pending() {
-    //printf("BREC pending queue: %zd entries\n",build.nbrp);
-
-    int i;
+    ssize_t i;
     char buf[256];
-    for(i=0; i<build.nbrp; i++) {
-        blkr *bl = &build.brp[i];
-        printf("%2d : %d,%d,%d (%s)\n", i,
-               bl->x, bl->y, bl->z, get_bid_name(buf, bl->b));
+    for(i=build.brphead; i<C(build.brp); i++) {
+        brpend *bp = P(build.brp)+i;
+        if (!bp->ts) continue;
+        printf("%2zd : %d,%d,%d (%s)\n", i-build.brphead,
+               bp->b.x, bp->b.y, bp->b.z, get_bid_name(buf, bp->b.b));
     }
 }
 
@@ -1546,19 +2301,16 @@ static void brec_blockupdate_blk(blkr b) {
     // clear the state-related bits
     b.b.meta &= ~(ITEMS[b.b.bid].flags&I_STATE_MASK);
 
-    int i;
-    for(i=0; i<build.nbrp; i++) {
-        blkr *bl = &build.brp[i];
-        if (bl->x==b.x && bl->y==b.y && bl->z==b.z) {
-            // remove block from the pending queue
-            blkr *brp = build.brp;
-            lh_arr_delete(brp, build.nbrp, 1, i);
+    if (!build.nbrpidx) return;
+    int32_t *slot = brp_slot(b.x,b.y,b.z);
+    if (!*slot) return;
 
-            // add the block to the buildplan
-            bplan_add(build.bp, abs2rel(build.pv, b));
-            return;
-        }
-    }
+    // remove block from the pending queue
+    P(build.brp)[*slot-1].ts = 0;
+    brp_unhash(slot);
+
+    // add the block to the buildplan
+    bplan_add(build.bp, abs2rel(build.pv, b));
 }
 
 // handler for the SP_BlockChange and SP_MultiBlockChange messages from the server
@@ -1619,26 +2371,24 @@ static void brec_blockplace(MCPacket *pkt) {
         }
     }
 
-    // verify if this block is already in the pending queue
-    int i;
-    for(i=0; i<build.nbrp; i++) {
-        blkr *bl = &build.brp[i];
-        if (bl->x == x && bl->y == y && bl->z == z) {
-            printf("BREC: warning, block %d,%d,%d already in the pending queue\n",x,y,z);
-            bl->b = b; // update the block ID just in case
-            return;
-        }
-    }
+    int64_t ts = gettimestamp();
+    brp_expire(ts);
+
+    // make room for a new entry, keeping the hash at most half full
+    if (2*(C(build.brp)+1) > build.nbrpidx)
+        brp_rehash();
 
-    if (build.nbrp >= MAXBUILDABLE) {
-        printf("Warning: ignoring block placement, pending block queue full!\n");
+    // verify if this block is already in the pending queue
+    int32_t *slot = brp_slot(x,y,z);
+    if (*slot) {
+        printf("BREC: warning, block %d,%d,%d already in the pending queue\n",x,y,z);
+        P(build.brp)[*slot-1].b.b = b; // update the block ID just in case
         return;
     }
 
     // create a new record in the pending queue
-    blkr *bl = &build.brp[build.nbrp];
-    build.nbrp++;
-    *bl = (blkr) {x,y,z,b};
+    *lh_arr_new(GAR(build.brp)) = (brpend) { {x,y,z,b}, ts };
+    *slot = C(build.brp);
 
     // if this is the first block being recorded, set it as pivot
     if (!build.pv.dir) {
@@ -1768,8 +2518,13 @@ void build_dump_task() {
 
 // dump our buildqueue to console
 void build_dump_queue() {
-    int i;
+    int i, n=0;
     char buf[256];
+
+    for(i=0; i<C(build.task); i++)
+        n += (P(build.task)[i].sent != 0);
+    printf("Placements waiting for the server: %d, RTT=%.1fms (+-%.1fms), retry after %.1fms\n",
+           n, build.srtt/1000.0, build.rttvar/1000.0, retry_interval()/1000.0);
     for(i=0; i<build.nbq; i++) {
         blk *b = P(build.task)+build.bq[i];
         printf("%3d %+5d,%+5d,%3d %3x/%02x dist=%.2f %c%c%c %c%c%c%c%c%c (%3d) material=%s\n",
@@ -1803,75 +2558,71 @@ void build_dump_queue() {
 #define PREVIEW_TRUE    2
 #define PREVIEW_REMOVE_NOQUEUE  3
 
+// is this buildtask block shown in the preview
+static inline int preview_block(blk *b) {
+    return !b->placed && !(build.limit && b->y>build.limit);
+}
+
 void build_show_preview(MCPacketQueue *sq, MCPacketQueue *cq, int mode) {
     if (C(build.task)<=0) return;
     build_update_placed();
 
-    int npackets=0;
-    MCPacket *packets[1000];
-    lh_clear_obj(packets);
+    MCPacketQueue *q = (mode==PREVIEW_REMOVE_NOQUEUE) ? cq : &build.preview_queue;
 
-    int i,j;
-    for(i=0; i<C(build.task); i++) {
-        blk *b = &P(build.task)[i];
-        if (build.limit && b->y>build.limit) continue;
-        if (b->placed) continue;
+    // the blocks are visited in chunk order, so every chunk gets exactly one
+    // packet and its blocks can be counted before the packet is made
+    int i=0, j;
+    while (i<C(build.task)) {
+        blk *b = P(build.task)+build.tord[i];
+        int32_t X = b->x>>4, Z = b->z>>4;
 
-        int32_t X=b->x>>4;
-        int32_t Z=b->z>>4;
+        int n=0;
+        for(j=i; j<C(build.task); j++) {
+            b = P(build.task)+build.tord[j];
+            if ((b->x>>4) != X || (b->z>>4) != Z) break;
+            n += preview_block(b);
+        }
+        int end = j;
 
         // skip blocks located in unloaded chunks
-        gschunk *gc = find_chunk(gs.world, X, Z, 0);
-        if (!gc) continue;
-
-        // see if we already have a packet for this chunk prepared
-        SP_MultiBlockChange_pkt *tpkt=NULL;
-        for(j=0; j<npackets; j++) {
-            if (packets[j]->_SP_MultiBlockChange.X==X &&
-                packets[j]->_SP_MultiBlockChange.Z==Z) {
-                tpkt = &packets[j]->_SP_MultiBlockChange;
-                break;
-            }
+        if (!n || !find_chunk(gs.world, X, Z, 0)) {
+            i = end;
+            continue;
         }
 
-        // no such packet - make new
-        if (!tpkt) {
-            if (npackets >= 1000) continue; // too many packets already - skip it
-            NEWPACKET(SP_MultiBlockChange, mbc);
-            packets[npackets++] = mbc;
-            tpkt = tmbc;
-            tmbc->X = X;
-            tmbc->Z = Z;
-        }
+        NEWPACKET(SP_MultiBlockChange, mbc);
+        tmbc->X = X;
+        tmbc->Z = Z;
+        lh_alloc_num(tmbc->blocks, n);
 
-        // depending on the preview mode, select which block will be shown
-        bid_t bid;
-        switch (mode) {
-            case PREVIEW_REMOVE:
-            case PREVIEW_REMOVE_NOQUEUE:
-                bid = b->current;
-                break;
-            case PREVIEW_MISSING:
-                bid = PREVIEW_BLOCK;
-                break;
-            case PREVIEW_TRUE:
-                bid = b->b;
-                break;
-        }
+        for(; i<end; i++) {
+            b = P(build.task)+build.tord[i];
+            if (!preview_block(b)) continue;
 
-        // add new block to the packet
-        lh_resize(tpkt->blocks, tpkt->count+1);
-        tpkt->blocks[tpkt->count].x = b->x&15;
-        tpkt->blocks[tpkt->count].z = b->z&15;
-        tpkt->blocks[tpkt->count].y = b->y;
-        tpkt->blocks[tpkt->count].bid = bid;
-        tpkt->count++;
-    }
+            // depending on the preview mode, select which block will be shown
+            bid_t bid;
+            switch (mode) {
+                case PREVIEW_REMOVE:
+                case PREVIEW_REMOVE_NOQUEUE:
+                    bid = b->current;
+                    break;
+                case PREVIEW_MISSING:
+                    bid = PREVIEW_BLOCK;
+                    break;
+                case PREVIEW_TRUE:
+                    bid = b->b;
+                    break;
+            }
 
-    for(i=0; i<npackets; i++)
-        queue_packet(packets[i], (mode==PREVIEW_REMOVE_NOQUEUE) ? cq : &build.preview_queue);
+            blkrec *br = tmbc->blocks+tmbc->count++;
+            br->x = b->x&15;
+            br->z = b->z&15;
+            br->y = b->y;
+            br->bid = bid;
+        }
 
-    //printf("Created %d packets\n",npackets);
+        queue_packet(mbc, q);
+    }
 }
 
 // rate-limited sending of preview packets to the client
@@ -1903,8 +2654,10 @@ void build_cancel(MCPacketQueue *sq, MCPacketQueue *cq) {
         build_show_preview(sq, cq, PREVIEW_REMOVE_NOQUEUE);
     build.active = 0;
     lh_arr_free(BTASK);
+    index_task();
+    gs_pin_extent(NULL);
     build.bq[0] = -1;
-    build.nbrp = 0; // clear the pending queue
+    brp_clear(); // clear the pending queue
     buildopts.sealmode = 0; // always cancel seal mode
 }
 
@@ -2165,6 +2918,7 @@ void build_cmd(char **words, MCPacketQueue *sq, MCPacketQueue *cq) {
         int flat = argflag(words, WORDLIST("flat","2d","2","f","xz"));
         int opaque = !argflag(words, WORDLIST("opaque","o"));
         int removed = bplan_hollow(build.bp, flat, opaque);
+        bplan_update(build.bp);
         sprintf(reply, "Removed %d blocks, kept %zd",removed,C(build.bp->plan));
         goto Place;
     }
@@ -2271,6 +3025,7 @@ void build_cmd(char **words, MCPacketQueue *sq, MCPacketQueue *cq) {
         NEEDBP;
         ARGDEF(count, NULL, count, 2);
         bplan_scale(build.bp, count);
+        bplan_update(build.bp);
         sprintf(reply, "Scale %d times to %zd blocks in a %dx%dx%d area\n",
                 count, C(build.bp->plan), build.bp->sx, build.bp->sz, build.bp->sy);
         goto Place;
@@ -2419,7 +3174,13 @@ void build_cmd(char **words, MCPacketQueue *sq, MCPacketQueue *cq) {
         if (argparse(words, names_set, fmt_set, set))
             sprintf(set, "wool");
 
-        bplan *bp = bplan_pngload(fname,set);
+        int dither = QDITHER_NONE;
+        if (argflag(words, WORDLIST("dither","d")))
+            dither = QDITHER_FS;
+        if (argflag(words, WORDLIST("ordered","o")))
+            dither = QDITHER_ORDERED;
+
+        bplan *bp = bplan_pngload(fname,set,dither);
 
         if (bp) {
             build_clear(sq, cq);
@@ -2586,6 +3347,11 @@ void build_cmd(char **words, MCPacketQueue *sq, MCPacketQueue *cq) {
         goto Error;
     }
 
+    CMD2(route,ro) {
+        print_route(reply);
+        goto Error;
+    }
+
     CMD2(limit,li) {
         if (!words[0]) {
             // set the limit to player's current y position
@@ -2634,6 +3400,8 @@ void build_cmd(char **words, MCPacketQueue *sq, MCPacketQueue *cq) {
 
 // dispatch for the building-relevant packets we get from mcp_game
 int build_packet(MCPacket *pkt, MCPacketQueue *sq, MCPacketQueue *cq) {
+    if (C(build.task)) ledger_packet(pkt);
+
     if (pkt->pid == SP_UpdateHealth && gs.own.health < 20) {
         if (build.active) {
             build.active = 0;
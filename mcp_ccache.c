@@ -0,0 +1,359 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LH_DECLARE_SHORT_NAMES 1
+
+#include <lh_buffers.h>
+
+#include "mcp_ccache.h"
+
+#define CC_HASH(X,Z) ((((uint32_t)(X)*73856093U)^((uint32_t)(Z)*19349663U))&(CCACHE_HSIZE-1))
+
+static void hash_link(ccache_t *cc, int32_t slot) {
+    uint32_t h = CC_HASH(cc->slots[slot].X, cc->slots[slot].Z);
+    cc->hnext[slot] = cc->hhead[h];
+    cc->hhead[h] = slot;
+}
+
+static void hash_unlink(ccache_t *cc, int32_t slot) {
+    int32_t *sp = &cc->hhead[CC_HASH(cc->slots[slot].X, cc->slots[slot].Z)];
+    while (*sp >= 0) {
+        if (*sp == slot) {
+            *sp = cc->hnext[slot];
+            return;
+        }
+        sp = &cc->hnext[*sp];
+    }
+}
+
+static void lru_unlink(ccache_t *cc, int32_t slot) {
+    int32_t p = cc->lprev[slot], n = cc->lnext[slot];
+    if (p >= 0) cc->lnext[p] = n; else cc->lru = n;
+    if (n >= 0) cc->lprev[n] = p; else cc->mru = p;
+}
+
+// add a slot at the most recently used end of the LRU list
+static void lru_append(ccache_t *cc, int32_t slot) {
+    cc->lprev[slot] = cc->mru;
+    cc->lnext[slot] = -1;
+    if (cc->mru >= 0) cc->lnext[cc->mru] = slot; else cc->lru = slot;
+    cc->mru = slot;
+}
+
+// add a slot at the least recently used end, to be reused first
+static void lru_prepend(ccache_t *cc, int32_t slot) {
+    cc->lprev[slot] = -1;
+    cc->lnext[slot] = cc->lru;
+    if (cc->lru >= 0) cc->lprev[cc->lru] = slot; else cc->mru = slot;
+    cc->lru = slot;
+}
+
+static inline void touch(ccache_t *cc, int32_t slot) {
+    cc->slots[slot].stamp = ++cc->hdr->stamp;
+    lru_unlink(cc, slot);
+    lru_append(cc, slot);
+}
+
+typedef struct {
+    uint32_t    stamp;
+    int32_t     slot;
+} ccache_order;
+
+static int order_compar(const void *a, const void *b) {
+    const ccache_order *oa = a, *ob = b;
+    if (oa->stamp != ob->stamp) return (oa->stamp > ob->stamp) - (oa->stamp < ob->stamp);
+    return oa->slot - ob->slot;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// section encoding
+
+// palette index lookup for the encoder - valid if pgen matches the current generation
+static uint32_t pgen[65536], curgen;
+static uint16_t pidx[65536];
+
+static inline int index_get(const uint8_t *idx, int bits, int i) {
+    int bo = i*bits;
+    return (idx[bo>>3]>>(bo&7)) & ((1<<bits)-1);
+}
+
+static inline void index_set(uint8_t *idx, int bits, int i, int v) {
+    int bo = i*bits;
+    uint8_t m = ((1<<bits)-1)<<(bo&7);
+    idx[bo>>3] = (idx[bo>>3]&~m) | ((v<<(bo&7))&m);
+}
+
+// encode the block sections of a chunk into the section data of es,
+// returns 0 if it does not fit into CCACHE_DATASIZE
+static int encode_chunk(ccache_slot *es, bid_t *blocks) {
+    uint32_t size = 0;
+    int sec, i;
+    for(sec=0; sec<16; sec++) {
+        bid_t *b = blocks+sec*4096;
+
+        // collect the palette
+        uint16_t pal[256];
+        int n = 0;
+        if (++curgen == 0) {
+            memset(pgen, 0, sizeof(pgen));
+            curgen = 1;
+        }
+        for(i=0; i<4096 && n<=256; i++) {
+            if (pgen[b[i].raw] == curgen) continue;
+            pgen[b[i].raw] = curgen;
+            if (n < 256) pal[n] = b[i].raw;
+            pidx[b[i].raw] = n++;
+        }
+
+        int bits = (n>256) ? 16 : (n>16) ? 8 : (n>4) ? 4 : (n>2) ? 2 : (n>1) ? 1 : 0;
+        uint32_t ssize = (bits==16) ? 4096*sizeof(bid_t) : n*sizeof(uint16_t)+4096*bits/8;
+        if (size+ssize > CCACHE_DATASIZE) return 0;
+
+        es->off[sec]  = size;
+        es->bits[sec] = bits;
+        uint8_t *p = es->data+size;
+        if (bits == 16) {
+            es->npal[sec] = 0;
+            memmove(p, b, 4096*sizeof(bid_t));
+        }
+        else {
+            es->npal[sec] = n;
+            memmove(p, pal, n*sizeof(uint16_t));
+            uint8_t *idx = p+n*sizeof(uint16_t);
+            memset(idx, 0, 4096*bits/8);
+            if (bits)
+                for(i=0; i<4096; i++)
+                    index_set(idx, bits, i, pidx[b[i].raw]);
+        }
+        size += ssize;
+    }
+
+    es->size = size;
+    return 1;
+}
+
+static void decode_chunk(ccache_slot *cs, bid_t *blocks) {
+    int sec, i;
+    for(sec=0; sec<16; sec++) {
+        bid_t *b = blocks+sec*4096;
+        uint8_t *p = cs->data+cs->off[sec];
+        int bits = cs->bits[sec];
+
+        if (bits == 16) {
+            memmove(b, p, 4096*sizeof(bid_t));
+            continue;
+        }
+
+        uint16_t *pal = (uint16_t *)p;
+        uint8_t *idx = p+cs->npal[sec]*sizeof(uint16_t);
+        for(i=0; i<4096; i++)
+            b[i].raw = pal[bits ? index_get(idx, bits, i) : 0];
+    }
+}
+
+// encoding buffer - a chunk is encoded here first, as it may not fit
+static ccache_slot enc;
+
+// copy the encoded sections into a slot
+static void put_encoded(ccache_slot *cs) {
+    cs->size = enc.size;
+    memmove(cs->off, enc.off, sizeof(cs->off));
+    memmove(cs->npal, enc.npal, sizeof(cs->npal));
+    memmove(cs->bits, enc.bits, sizeof(cs->bits));
+    memmove(cs->data, enc.data, enc.size);
+}
+
+// make a slot unused and put it first in line for reuse
+static void drop_slot(ccache_t *cc, int32_t slot) {
+    hash_unlink(cc, slot);
+    cc->slots[slot].stamp = 0;
+    lru_unlink(cc, slot);
+    lru_prepend(cc, slot);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+ccache_t * ccache_open(const char *path, int maxmb) {
+    int32_t nslots = ((int64_t)maxmb<<20)/sizeof(ccache_slot);
+    if (nslots < 1) {
+        printf("Chunk cache limit of %d MB is too small\n", maxmb);
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR|O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Failed to open chunk cache %s\n", path);
+        return NULL;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+
+    // an existing cache with a different size keeps the slots that still fit,
+    // a file with a wrong header is reinitialized
+    size_t size = sizeof(ccache_hdr)+(size_t)nslots*sizeof(ccache_slot);
+    int valid = 0;
+    if (st.st_size >= sizeof(ccache_hdr)) {
+        ccache_hdr h;
+        valid = (pread(fd, &h, sizeof(h), 0) == sizeof(h) && !memcmp(h.magic, CCACHE_MAGIC, 8));
+    }
+    if (!valid && ftruncate(fd, 0) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if (ftruncate(fd, size) < 0) {
+        printf("Failed to resize chunk cache %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        printf("Failed to map chunk cache %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    lh_create_obj(ccache_t, cc);
+    cc->fd     = fd;
+    cc->map    = map;
+    cc->size   = size;
+    cc->hdr    = (ccache_hdr *)map;
+    cc->slots  = (ccache_slot *)(map+sizeof(ccache_hdr));
+    cc->nslots = nslots;
+    lh_alloc_num(cc->lprev, nslots);
+    lh_alloc_num(cc->lnext, nslots);
+    lh_alloc_num(cc->hnext, nslots);
+    cc->lru = cc->mru = -1;
+
+    if (!valid)
+        memmove(cc->hdr->magic, CCACHE_MAGIC, 8);
+
+    int32_t i;
+    for(i=0; i<CCACHE_HSIZE; i++)
+        cc->hhead[i] = -1;
+
+    // build the LRU list from the stored stamps, unused slots come first
+    lh_create_num(ccache_order, order, nslots);
+    int32_t used = 0;
+    for(i=0; i<nslots; i++) {
+        order[i].stamp = cc->slots[i].stamp;
+        order[i].slot  = i;
+        if (cc->slots[i].stamp) {
+            hash_link(cc, i);
+            used++;
+        }
+    }
+    qsort(order, nslots, sizeof(order[0]), order_compar);
+    for(i=0; i<nslots; i++)
+        lru_append(cc, order[i].slot);
+    lh_free(order);
+
+    printf("Chunk cache %s : %d of %d slots used\n", path, used, nslots);
+    return cc;
+}
+
+void ccache_close(ccache_t *cc) {
+    if (!cc) return;
+    msync(cc->map, cc->size, MS_ASYNC);
+    munmap(cc->map, cc->size);
+    close(cc->fd);
+    lh_free(cc->lprev);
+    lh_free(cc->lnext);
+    lh_free(cc->hnext);
+    lh_free(cc);
+}
+
+// slot index of a cached chunk, -1 if not cached
+int32_t ccache_find(ccache_t *cc, int32_t X, int32_t Z) {
+    int32_t s;
+    for(s=cc->hhead[CC_HASH(X,Z)]; s>=0; s=cc->hnext[s])
+        if (cc->slots[s].X == X && cc->slots[s].Z == Z)
+            return s;
+    return -1;
+}
+
+// decode a cached chunk into the provided buffers, returns 0 if not cached
+int ccache_load(ccache_t *cc, int32_t X, int32_t Z, bid_t *blocks, uint8_t *biome) {
+    int32_t s = ccache_find(cc, X, Z);
+    if (s < 0) return 0;
+
+    decode_chunk(&cc->slots[s], blocks);
+    memmove(biome, cc->slots[s].biome, sizeof(cc->slots[s].biome));
+    touch(cc, s);
+    return 1;
+}
+
+void ccache_store(ccache_t *cc, int32_t X, int32_t Z, bid_t *blocks, uint8_t *biome) {
+    int32_t s = ccache_find(cc, X, Z);
+
+    if (!encode_chunk(&enc, blocks)) {
+        // too many different blocks - do not keep an outdated copy either
+        if (s >= 0) drop_slot(cc, s);
+        return;
+    }
+
+    if (s < 0) {
+        // take the least recently used slot - unused slots have stamp 0
+        s = cc->lru;
+        if (cc->slots[s].stamp) hash_unlink(cc, s);
+        cc->slots[s].X = X;
+        cc->slots[s].Z = Z;
+        hash_link(cc, s);
+    }
+
+    ccache_slot *cs = &cc->slots[s];
+    put_encoded(cs);
+    memmove(cs->biome, biome, sizeof(cs->biome));
+    touch(cc, s);
+}
+
+// update a single block of a cached chunk, if it's cached at all
+void ccache_set_block(ccache_t *cc, int32_t X, int32_t Z, int32_t boff, bid_t b) {
+    int32_t s = ccache_find(cc, X, Z);
+    if (s < 0) return;
+
+    ccache_slot *cs = &cc->slots[s];
+    int sec = boff>>12, i = boff&4095;
+    uint8_t *p = cs->data+cs->off[sec];
+    int bits = cs->bits[sec];
+
+    if (bits == 16) {
+        ((bid_t *)p)[i] = b;
+        return;
+    }
+
+    // the block is in the section palette already - just update the index
+    uint16_t *pal = (uint16_t *)p;
+    int n = cs->npal[sec], k;
+    for(k=0; k<n; k++) {
+        if (pal[k] != b.raw) continue;
+        if (bits) index_set(p+n*sizeof(uint16_t), bits, i, k);
+        return;
+    }
+
+    // a new block for this section - encode the chunk again
+    static bid_t blocks[65536];
+    decode_chunk(cs, blocks);
+    blocks[boff] = b;
+    if (!encode_chunk(&enc, blocks)) {
+        drop_slot(cc, s);
+        return;
+    }
+    put_encoded(cs);
+}
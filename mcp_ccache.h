@@ -0,0 +1,78 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+#pragma once
+
+/*
+ mcp_ccache : persistent on-disk chunk cache
+
+ A cache file holds a fixed number of chunk slots, memory-mapped as a whole.
+ Writes go directly into the mapping and are written back by the kernel.
+ When all slots are in use, the least recently used chunk is replaced.
+
+ The blocks are stored palette-compressed per section: a palette of the
+ block IDs used in the section and an index per block with 0,1,2,4 or 8
+ bits. Sections with more than 256 different blocks are stored raw.
+ A slot has room for CCACHE_DATASIZE bytes of section data - about a third
+ of the raw block array, enough for the natural terrain. Chunks that do
+ not fit are not cached
+*/
+
+#include <stdint.h>
+
+#include "mcp_types.h"
+
+#define CCACHE_MAGIC    "MCPCC002"
+#define CCACHE_HSIZE    4096    // hash table size for the chunk lookup
+
+typedef struct {
+    char        magic[8];
+    uint32_t    stamp;          // last used LRU stamp
+    uint32_t    pad;
+} ccache_hdr;
+
+#define CCACHE_DATASIZE (48*1024)
+
+typedef struct {
+    int32_t     X,Z;
+    uint32_t    stamp;          // last access, 0 if the slot is unused
+    uint32_t    size;           // bytes used in data
+    uint32_t    off[16];        // offset of each section in data
+    uint16_t    npal[16];       // palette size of each section, 0 if stored raw
+    uint8_t     bits[16];       // bits per block index, 16 if stored raw
+    uint8_t     biome[256];
+    uint8_t     data[CCACHE_DATASIZE]; // per section: palette, then the block indices
+} ccache_slot;
+
+typedef struct {
+    int             fd;
+    uint8_t        *map;
+    size_t          size;
+    ccache_hdr     *hdr;
+    ccache_slot    *slots;
+    int32_t         nslots;
+
+    // slots in the LRU order - doubly linked list, -1 terminated,
+    // from the least recently used (or unused) slot to the most recent one
+    int32_t        *lprev, *lnext;
+    int32_t         lru, mru;
+
+    // slot lookup by chunk coords - hash chains, -1 terminated
+    int32_t         hhead[CCACHE_HSIZE];
+    int32_t        *hnext;
+} ccache_t;
+
+ccache_t * ccache_open(const char *path, int maxmb);
+void ccache_close(ccache_t *cc);
+
+int32_t ccache_find(ccache_t *cc, int32_t X, int32_t Z);
+int  ccache_load(ccache_t *cc, int32_t X, int32_t Z, bid_t *blocks, uint8_t *biome);
+void ccache_store(ccache_t *cc, int32_t X, int32_t Z, bid_t *blocks, uint8_t *biome);
+void ccache_set_block(ccache_t *cc, int32_t X, int32_t Z, int32_t boff, bid_t b);
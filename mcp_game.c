@@ -29,6 +29,8 @@
 #include "mcp_types.h"
 #include "helpers.h"
 #include "hud.h"
+#include "mcp_stats.h"
+#include "mcp_play.h"
 
 // from mcproxy.c
 void drop_connection();
@@ -104,15 +106,44 @@ static inline double mydist(double x, double y, double z) {
 
 TBDEF(tb_ak, MIN_ATTACK_DELAY, MAX_ATTACK);
 
+// how dangerous a hostile mob is at close range - creepers first, as they
+// blow up blocks along with the player, then the mobs dealing heavy damage
+static int threat_level(EntityType mtype) {
+    switch (mtype) {
+        case Creeper:               return 3;
+        case VindicationIllager:
+        case EvocationIllager:
+        case WitherSkeleton:
+        case Vex:
+        case Witch:
+        case CaveSpider:            return 2;
+        default:                    return 1;
+    }
+}
+
+// more dangerous entities first, then the closest ones
+static int threat_compar(const void *a, const void *b) {
+    const entity_near *ea = a, *eb = b;
+    int ta = threat_level(P(gs.entity)[ea->idx].mtype);
+    int tb = threat_level(P(gs.entity)[eb->idx].mtype);
+    if (ta != tb) return tb-ta;
+    return (ea->dist > eb->dist) - (ea->dist < eb->dist);
+}
+
 static void autokill(MCPacketQueue *sq) {
     if (!tb_event(&tb_ak, 1)) return;
 
+    // entities within our reach, sorted by distance
+    entity_near near[MAX_ENTITIES];
+    int n = gs_entities_in_range(gs.own.x, HEADPOSY(gs.own.y), gs.own.z,
+                                 REACH_RANGE, near, MAX_ENTITIES);
+
     // calculate list of hostile entities in range
-    uint32_t hent[MAX_ENTITIES];
+    entity_near hent[MAX_ENTITIES];
 
     int i,hi=0;
-    for(i=0; i<C(gs.entity) && hi<MAX_ENTITIES; i++) {
-        entity *e = P(gs.entity)+i;
+    for(i=0; i<n; i++) {
+        entity *e = P(gs.entity)+near[i].idx;
 
         // skip non-hostile entities
         if (!e->hostile) continue;
@@ -123,16 +154,16 @@ static void autokill(MCPacketQueue *sq) {
         // skip entities we hit only recently
         if ((tb_ak.last-e->lasthit) < MIN_ENTITY_DELAY) continue;
 
-        // only take entities that are within our reach
-        if (mydist(e->x, e->y, e->z)<=REACH_RANGE)
-            hent[hi++] = i;
+        hent[hi++] = near[i];
     }
-    //TODO: sort entities by how dangerous and how close they are
+
+    // sort entities by how dangerous and how close they are
+    qsort(hent, hi, sizeof(hent[0]), threat_compar);
     //TODO: check for obstruction
     //TODO: adjust for cooldown time
 
     for(i=0; i<hi && i<MAX_ATTACK; i++) {
-        entity *e = P(gs.entity)+hent[i];
+        entity *e = P(gs.entity)+hent[i].idx;
         //printf("Attacking entity %08x\n",e->id);
 
         e->lasthit = tb_ak.last;
@@ -164,12 +195,17 @@ static void autoshear(MCPacketQueue *sq) {
     // rate-limit
     if (!tb_event(&tb_ash, 1)) return;
 
+    // entities within our reach, sorted by distance
+    entity_near near[MAX_ENTITIES];
+    int n = gs_entities_in_range(gs.own.x, HEADPOSY(gs.own.y), gs.own.z,
+                                 REACH_RANGE, near, MAX_ENTITIES);
+
     // calculate list of usable entities in range
     uint32_t hent[MAX_ENTITIES];
 
     int i,hi=0;
-    for(i=0; i<C(gs.entity) && hi<MAX_ENTITIES; i++) {
-        entity *e = P(gs.entity)+i;
+    for(i=0; i<n; i++) {
+        entity *e = P(gs.entity)+near[i].idx;
 
         // check if the entity is a sheep
         if (e->mtype != Sheep) continue;
@@ -178,17 +214,17 @@ static void autoshear(MCPacketQueue *sq) {
 
         // skip sheared sheep
         int midx_color = currentProtocol<PROTO_1_10 ? 12 : 13;
-        assert(e->mdata[midx_color].type == META_BYTE);
-        if (e->mdata[midx_color].b >= 0x10) continue;
+        metadata *color = get_metadata(e->mdata, midx_color);
+        assert(color && color->type == META_BYTE);
+        if (color->b >= 0x10) continue;
 
         // skip baby sheep
         int midx_baby = currentProtocol<PROTO_1_10 ? 11 : 12;
-        assert(e->mdata[midx_baby].type == META_BOOL);
-        if (e->mdata[midx_baby].bool) continue;
+        metadata *baby = get_metadata(e->mdata, midx_baby);
+        assert(baby && baby->type == META_BOOL);
+        if (baby->bool) continue;
 
-        // only take entities that are within our reach
-        if (mydist(e->x, e->y, e->z)<=REACH_RANGE)
-            hent[hi++] = i;
+        hent[hi++] = near[i].idx;
     }
 
     for(i=0; i<hi && i<MAX_ATTACK; i++) {
@@ -873,18 +909,12 @@ void freecam(MCPacketQueue *cq) {
     tpa2->fov   = 0.1;
     queue_packet(pa2, cq);
 
-    metadata player[32];
-    lh_clear_obj(player);
-    player[0].key = 0;
-    player[0].type = META_BYTE;
-    player[0].b = opt.freecam ? 0x20 : 0;
-    int i;
-    for(i=1; i<32; i++)
-        player[i].type = META_NONE;
-
     NEWPACKET(SP_EntityMetadata, em);
     tem->eid = gs.own.eid;
-    tem->meta = clone_metadata(player);
+    tem->meta = alloc_metadata(1<<0);
+    metadata *flags = get_metadata(tem->meta, 0);
+    flags->type = META_BYTE;
+    flags->b = opt.freecam ? 0x20 : 0;
     queue_packet(em, cq);
 }
 
@@ -1039,6 +1069,50 @@ void handle_command(char *str, MCPacketQueue *tq, MCPacketQueue *bq) {
     else if (!strcmp(words[0],"map") || !strcmp(words[0],"hud")) {
         hud_cmd(words, tq, bq);
     }
+    else if (!strcmp(words[0],"zlib")) {
+        int backend = play_zopt.backend;
+        int level = play_zopt.level;
+        int strategy = play_zopt.strategy;
+
+        if (words[1] && words[2]) {
+            if (!strcmp(words[1],"backend"))
+                backend = play_zbackend_byname(words[2]);
+            else if (!strcmp(words[1],"level"))
+                level = atoi(words[2]);
+            else if (!strcmp(words[1],"strategy"))
+                strategy = play_zstrategy_byname(words[2]);
+        }
+
+        if (!play_zconfig(backend, level, strategy)) {
+            sprintf(reply,"Usage: zlib [backend oneshot|zlib|libdeflate | level -1..9 | "
+                    "strategy default|filtered|huffman|rle|fixed]");
+        }
+        else {
+            sprintf(reply,"Compression: backend=%s level=%d strategy=%s",
+                    play_zbackend_name(play_zopt.backend), play_zopt.level,
+                    play_zstrategy_name(play_zopt.strategy));
+        }
+    }
+    else if (!strcmp(words[0],"stats")) {
+        if (words[1] && !strcmp(words[1],"reset")) {
+            st_reset();
+            sprintf(reply,"Latency statistics reset");
+        }
+        else if (words[1] && !strcmp(words[1],"off")) {
+            st_enabled = 0;
+            sprintf(reply,"Latency statistics disabled");
+        }
+        else if (words[1] && !strcmp(words[1],"on")) {
+            st_enabled = 1;
+            sprintf(reply,"Latency statistics enabled");
+        }
+        else {
+            // full per-packet-type dump goes to the console
+            st_dump(1);
+            int n = sprintf(reply,"p50/p99 us: ");
+            st_summary(reply+n);
+        }
+    }
     else if (!strcmp(words[0],"align")) {
         float yaw = 0;
         if (!(words[1] && sscanf(words[1], "%f", &yaw) == 1)) {
@@ -1226,8 +1300,9 @@ void gm_packet(MCPacket *pkt, MCPacketQueue *tq, MCPacketQueue *bq) {
         } _GMP;
 
         GMP(SP_EntityMetadata) {
-            if (tpkt->eid==gs.own.eid && opt.freecam) {
-                tpkt->meta[0].b |= 0x20;
+            metadata *flags = get_metadata(tpkt->meta, 0);
+            if (tpkt->eid==gs.own.eid && opt.freecam && flags) {
+                flags->b |= 0x20;
                 pkt->modified = 1;
             }
             queue_packet(pkt, tq);
@@ -1237,6 +1312,7 @@ void gm_packet(MCPacket *pkt, MCPacketQueue *tq, MCPacketQueue *bq) {
         // World data
 
         GMP(SP_ChunkData) {
+            if (!build_packet(pkt, sq, cq)) break;
             if (opt.xray) xray_filter(pkt);
             queue_packet(pkt, tq);
         } _GMP;
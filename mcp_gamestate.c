@@ -39,6 +39,88 @@ static inline int find_entity(int eid) {
     return -1;
 }
 
+#define EGRID_CELL(c) (((int32_t)floor(c))>>EGRID_SHIFT)
+#define EGRID_HASH(cx,cz) ((((uint32_t)(cx)*73856093U)^((uint32_t)(cz)*19349663U))&(EGRID_HSIZE-1))
+
+static void egrid_link(int idx) {
+    entity *e = P(gs.entity)+idx;
+    e->gcx = EGRID_CELL(e->x);
+    e->gcz = EGRID_CELL(e->z);
+
+    int32_t *head = &gs.egrid[EGRID_HASH(e->gcx,e->gcz)];
+    e->gprev = -1;
+    e->gnext = *head;
+    if (*head >= 0) P(gs.entity)[*head].gprev = idx;
+    *head = idx;
+}
+
+static void egrid_unlink(int idx) {
+    entity *e = P(gs.entity)+idx;
+    if (e->gprev >= 0)
+        P(gs.entity)[e->gprev].gnext = e->gnext;
+    else
+        gs.egrid[EGRID_HASH(e->gcx,e->gcz)] = e->gnext;
+    if (e->gnext >= 0)
+        P(gs.entity)[e->gnext].gprev = e->gprev;
+}
+
+// relink the entity if its position has moved it to another cell
+static void egrid_move(int idx) {
+    entity *e = P(gs.entity)+idx;
+    if (e->gcx == EGRID_CELL(e->x) && e->gcz == EGRID_CELL(e->z)) return;
+    egrid_unlink(idx);
+    egrid_link(idx);
+}
+
+// remove an entity from the tracking list - the last entity is moved
+// into its place, so the indices of other entities remain valid
+static void delete_entity(int idx) {
+    free_metadata(P(gs.entity)[idx].mdata);
+    egrid_unlink(idx);
+
+    int last = C(gs.entity)-1;
+    if (idx < last) {
+        egrid_unlink(last);
+        P(gs.entity)[idx] = P(gs.entity)[last];
+        egrid_link(idx);
+    }
+    C(gs.entity)--;
+}
+
+static int entity_near_compar(const void *a, const void *b) {
+    const entity_near *ea = a, *eb = b;
+    return (ea->dist > eb->dist) - (ea->dist < eb->dist);
+}
+
+// find tracked entities within range of a point. Only the grid cells
+// overlapping the range are visited. Results are sorted by distance
+int gs_entities_in_range(double x, double y, double z, double range,
+                         entity_near *res, int max) {
+    int32_t cx0 = EGRID_CELL(x-range), cx1 = EGRID_CELL(x+range);
+    int32_t cz0 = EGRID_CELL(z-range), cz1 = EGRID_CELL(z+range);
+
+    int n=0;
+    int32_t cx,cz,i;
+    for(cx=cx0; cx<=cx1; cx++) {
+        for(cz=cz0; cz<=cz1; cz++) {
+            for(i=gs.egrid[EGRID_HASH(cx,cz)]; i>=0; i=P(gs.entity)[i].gnext) {
+                entity *e = P(gs.entity)+i;
+                // skip entities from other cells sharing the same bucket
+                if (e->gcx!=cx || e->gcz!=cz) continue;
+
+                double dist = sqrt(SQ(e->x-x)+SQ(e->y-y)+SQ(e->z-z));
+                if (dist>range || n>=max) continue;
+                res[n].idx = i;
+                res[n].dist = dist;
+                n++;
+            }
+        }
+    }
+
+    qsort(res, n, sizeof(res[0]), entity_near_compar);
+    return n;
+}
+
 void dump_entities() {
     printf("Tracking %zd entities:\n",C(gs.entity));
     int i;
@@ -55,8 +137,18 @@ void dump_entities() {
 ////////////////////////////////////////////////////////////////////////////////
 // chunk storage
 
+static void update_height(gschunk *gc, int col, int y);
+static void update_bmask(gschunk *gc, int sec);
+static void enforce_budget();
+
+// whether a chunk that is not in memory can be loaded from the chunk cache
+static inline int in_cache(gsworld *w, int32_t X, int32_t Z) {
+    return w->cache && ccache_find(w->cache, X, Z) >= 0;
+}
+
 // return pointer to a gschunk with chunk coords X,Z
 // NULL, if chunk, or its region/superregion are not allocated
+// and the chunk is not available in the chunk cache
 gschunk * find_chunk(gsworld *w, int32_t X, int32_t Z, int allocate) {
     if (gs.opt.region_limit)
         if ((X>>5)<gs.xmin || (Z>>5)<gs.zmin || (X>>5)>gs.xmax || (Z>>5)>gs.zmax)
@@ -64,33 +156,77 @@ gschunk * find_chunk(gsworld *w, int32_t X, int32_t Z, int allocate) {
 
     int32_t si = CC_2(X,Z);
     if (!w->sreg[si]) {
-        if (!allocate) return NULL;
+        if (!allocate && !in_cache(w,X,Z)) return NULL;
         lh_alloc_obj(w->sreg[si]);
     }
     gssreg * sreg = w->sreg[si];
 
     int32_t ri = CC_1(X,Z);
     if (!sreg->region[ri]) {
-        if (!allocate) return NULL;
+        if (!allocate && !in_cache(w,X,Z)) return NULL;
         lh_alloc_obj(sreg->region[ri]);
     }
     gsregion * region = sreg->region[ri];
 
     int32_t ci = CC_0(X,Z);
     if (!region->chunk[ci]) {
-        if (!allocate) return NULL;
+        if (!allocate && !in_cache(w,X,Z)) return NULL;
         lh_alloc_obj(region->chunk[ci]);
+
+        gschunk * gc = region->chunk[ci];
+        gc->X = X;
+        gc->Z = Z;
+        gc->lidx = C(w->chunks);
+        *lh_arr_new(GAR(w->chunks)) = gc;
+
+        int i;
+        for(i=0; i<16; i++)
+            gc->bmask[i] = BMASK_BIT(0);
+
+        // load the chunk lazily from the cache - light and tile entities are not cached.
+        // It's accounted for in the memory budget later by release_cache_loads,
+        // as the caller may hold pointers to other chunks while sweeping an area
+        if (w->cache && ccache_load(w->cache, X, Z, gc->blocks, gc->biome)) {
+            for(i=0; i<256; i++)
+                update_height(gc, i, 255);
+            for(i=0; i<16; i++)
+                update_bmask(gc, i);
+            // full brightness, so the chunk is not shown pitch-black when resent to the client
+            memset(gc->light, 0xff, sizeof(gc->light));
+            memset(gc->skylight, 0xff, sizeof(gc->skylight));
+            gc->cached = 1;
+            gs.cache_loads = 1;
+        }
     }
     gschunk * chunk = region->chunk[ci];
+    chunk->stamp = ++gs.chunk_stamp;
 
     return chunk;
 }
 
-// add/replace chunk data, allocating storage if necessary
-// return pointer to the chunk
-static gschunk * insert_chunk(chunk_t *c, int cont) {
+// recalculate the height map of a single column, starting from y downward
+static void update_height(gschunk *gc, int col, int y) {
+    while (y>=0 && !gc->blocks[(y<<8)+col].bid) y--;
+    gc->height[col] = y+1;
+}
+
+// rebuild the block presence summary of a section
+static void update_bmask(gschunk *gc, int sec) {
+    bid_t *b = gc->blocks+sec*4096;
+    uint64_t m = 0;
+    int i;
+    for(i=0; i<4096; i++)
+        m |= BMASK_BIT(b[i].bid);
+    gc->bmask[sec] = m;
+}
+
+// add/replace chunk data, allocating storage if necessary.
+// The chunk may be evicted right away by the memory budget, its data is
+// then only available from the chunk cache
+static void insert_chunk(chunk_t *c, int cont) {
     gschunk * gc = find_chunk(gs.world, c->X, c->Z, 1);
-    if (!gc) return NULL;
+    if (!gc) return;
+    gc->cached = 0;
 
     int i;
     for(i=0; i<16; i++) {
@@ -98,22 +234,29 @@ static gschunk * insert_chunk(chunk_t *c, int cont) {
             memmove(gc->blocks+i*4096,   c->cubes[i]->blocks,   4096*sizeof(bid_t));
             memmove(gc->light+i*2048,    c->cubes[i]->light,    2048*sizeof(light_t));
             memmove(gc->skylight+i*2048, c->cubes[i]->skylight, 2048*sizeof(light_t));
+            update_bmask(gc, i);
         }
         else if (cont) {
             memset(gc->blocks+i*4096,   0, 4096*sizeof(bid_t));
             memset(gc->light+i*2048,    0, 2048*sizeof(light_t));
             memset(gc->skylight+i*2048, 0, 2048*sizeof(light_t));
+            gc->bmask[i] = BMASK_BIT(0);
         }
     }
 
     if (cont)
         memmove(gc->biome, c->biome, 256);
-    return gc;
-}
 
-static void remove_chunk(int32_t X, int32_t Z) {
-    gsworld *w = gs.world;
+    for(i=0; i<256; i++)
+        update_height(gc, i, 255);
+
+    if (gs.world->cache)
+        ccache_store(gs.world->cache, c->X, c->Z, gc->blocks, gc->biome);
+
+    enforce_budget();
+}
 
+static void remove_chunk(gsworld *w, int32_t X, int32_t Z) {
     int32_t si = CC_2(X,Z);
     if (!w->sreg[si]) return;
     gssreg * sreg = w->sreg[si];
@@ -123,8 +266,16 @@ static void remove_chunk(int32_t X, int32_t Z) {
     gsregion * region = sreg->region[ri];
 
     int32_t ci = CC_0(X,Z);
-    if (region->chunk[ci])
-        nbt_free(region->chunk[ci]->tent);
+    gschunk * gc = region->chunk[ci];
+    if (gc) {
+        nbt_free(gc->tent);
+
+        // remove from the chunk list, moving the last entry in its place
+        gschunk * last = P(w->chunks)[C(w->chunks)-1];
+        P(w->chunks)[gc->lidx] = last;
+        last->lidx = gc->lidx;
+        C(w->chunks)--;
+    }
     lh_free(region->chunk[ci]);
 
     //TODO: deallocate regions/superregions that become empty
@@ -154,6 +305,91 @@ static void free_chunks(gsworld *w) {
         }
     }
     lh_clear_num(w->sreg, 512*512);
+    lh_arr_free(GAR(w->chunks));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// chunk memory budget
+
+void gs_pin_extent(extent_t *ex) {
+    gs.pinned = (ex != NULL);
+    if (ex) gs.pin = *ex;
+}
+
+static int chunk_pinned(gsworld *w, gschunk *gc) {
+    if (w != gs.world) return 0;
+
+    int32_t PX = ((int32_t)floor(gs.own.x))>>4;
+    int32_t PZ = ((int32_t)floor(gs.own.z))>>4;
+    if (abs(gc->X-PX)<=PIN_RADIUS && abs(gc->Z-PZ)<=PIN_RADIUS) return 1;
+
+    return gs.pinned &&
+        gc->X >= (gs.pin.min.x>>4) && gc->X <= (gs.pin.max.x>>4) &&
+        gc->Z >= (gs.pin.min.z>>4) && gc->Z <= (gs.pin.max.z>>4);
+}
+
+typedef struct {
+    gsworld    *w;
+    gschunk    *gc;
+} gsevict;
+
+static int evict_compar(const void *a, const void *b) {
+    const gsevict *ea = a, *eb = b;
+    return (ea->gc->stamp > eb->gc->stamp) - (ea->gc->stamp < eb->gc->stamp);
+}
+
+// evict the least recently used chunks if the storage is over the budget.
+// Eviction goes down to 90% of the budget, so it does not run for every new chunk
+static void enforce_budget() {
+    if (!gs.opt.max_mb) return;
+
+    ssize_t limit = ((int64_t)gs.opt.max_mb<<20)/sizeof(gschunk);
+    gsworld *worlds[3] = { &gs.overworld, &gs.nether, &gs.end };
+
+    ssize_t total = 0;
+    int i,j;
+    for(i=0; i<3; i++)
+        total += C(worlds[i]->chunks);
+    if (total <= limit) return;
+
+    lh_create_num(gsevict, cand, total);
+    ssize_t nc = 0;
+    for(i=0; i<3; i++) {
+        for(j=0; j<C(worlds[i]->chunks); j++) {
+            gschunk *gc = P(worlds[i]->chunks)[j];
+            if (chunk_pinned(worlds[i], gc)) continue;
+            cand[nc].w  = worlds[i];
+            cand[nc].gc = gc;
+            nc++;
+        }
+    }
+    qsort(cand, nc, sizeof(cand[0]), evict_compar);
+
+    ssize_t nevict = MIN(total-limit*9/10, nc);
+    for(i=0; i<nevict; i++)
+        remove_chunk(cand[i].w, cand[i].gc->X, cand[i].gc->Z);
+
+    lh_free(cand);
+}
+
+// enforce the memory budget after chunks were loaded from the cache. With
+// prune_chunks, the chunks the server has not sent (or has unloaded) are
+// not kept at all, except those near the player or in the pinned extent
+static void release_cache_loads() {
+    if (!gs.cache_loads) return;
+    gs.cache_loads = 0;
+
+    if (gs.opt.prune_chunks) {
+        gsworld *w = gs.world;
+        ssize_t i;
+        for(i=C(w->chunks)-1; i>=0; i--) {
+            gschunk *gc = P(w->chunks)[i];
+            if (gc->cached && !chunk_pinned(w, gc))
+                remove_chunk(w, gc->X, gc->Z);
+        }
+    }
+
+    enforce_budget();
 }
 
 static void change_dimension(int dimension) {
@@ -170,15 +406,50 @@ static void change_dimension(int dimension) {
     }
 }
 
-static void modify_blocks(int32_t X, int32_t Z, blkrec *blocks, int32_t count) {
-    gschunk * gc = find_chunk(gs.world, X, Z, 1);
-    if (!gc) return;
+// return pointer to a gschunk if it's in memory, without allocating
+// or loading it from the chunk cache
+static gschunk * resident_chunk(gsworld *w, int32_t X, int32_t Z) {
+    gssreg * sreg = w->sreg[CC_2(X,Z)];
+    if (!sreg) return NULL;
+    gsregion * region = sreg->region[CC_1(X,Z)];
+    if (!region) return NULL;
+    return region->chunk[CC_0(X,Z)];
+}
 
+static void modify_blocks(int32_t X, int32_t Z, blkrec *blocks, int32_t count) {
     int i;
+
+    // chunks evicted by the memory budget are not resident anymore - update
+    // only their cached copy. Updates for chunks we have no data for at all
+    // are dropped, allocating them would create air in place of the terrain
+    gschunk * gc = resident_chunk(gs.world, X, Z);
+    if (!gc) {
+        if (gs.world->cache)
+            for(i=0; i<count; i++)
+                ccache_set_block(gs.world->cache, X, Z,
+                                 ((int32_t)blocks[i].y<<8)+(blocks[i].z<<4)+blocks[i].x,
+                                 blocks[i].bid);
+        return;
+    }
+    gc->stamp = ++gs.chunk_stamp;
+
     for(i=0; i<count; i++) {
         blkrec *b = blocks+i;
-        int32_t boff = ((int32_t)b->y<<8)+(b->z<<4)+b->x;
+        int32_t col  = (b->z<<4)+b->x;
+        int32_t boff = ((int32_t)b->y<<8)+col;
         gc->blocks[boff] = b->bid;
+        gc->bmask[b->y>>4] |= BMASK_BIT(b->bid.bid);
+        if (gs.world->cache)
+            ccache_set_block(gs.world->cache, X, Z, boff, b->bid);
+
+        if (b->bid.bid) {
+            if (b->y >= gc->height[col])
+                gc->height[col] = b->y+1;
+        }
+        else if (b->y+1 == gc->height[col]) {
+            // top block removed
+            update_height(gc, col, b->y);
+        }
     }
 }
 
@@ -492,6 +763,94 @@ cuboid_t export_cuboid_extent(extent_t ex) {
     return c;
 }
 
+// 16-bit mask of the non-air blocks in a chunk row, tested 4 blocks
+// per 64-bit word. bid_t keeps the meta in the low 4 bits
+static inline uint32_t occ_row_nonair(bid_t *row) {
+    uint32_t mask = 0;
+    int i;
+    for(i=0; i<4; i++) {
+        uint64_t w;
+        memcpy(&w, row+i*4, sizeof(w));
+        w &= 0xfff0fff0fff0fff0ULL;
+
+        // set the top bit of every non-zero 16-bit lane, then gather
+        // the four top bits into the low nibble
+        uint64_t t = (((w&0x7fff7fff7fff7fffULL)+0x7fff7fff7fff7fffULL)|w)&0x8000800080008000ULL;
+        mask |= (uint32_t)(((t>>15)*0x0001000200040008ULL)>>48)<<(i*4);
+    }
+    return mask;
+}
+
+// block class lookup table for the last used predicate
+static uint8_t   occ_lut[4096];
+static bidpred_t occ_lut_pred = NULL;
+
+static inline uint32_t occ_row_class(bid_t *row) {
+    uint32_t mask = 0;
+    int i;
+    for(i=0; i<16; i++)
+        mask |= (uint32_t)occ_lut[row[i].bid]<<i;
+    return mask;
+}
+
+// export the occupancy of an extent as a bitmap - a block is set if it is
+// not air, or if pred returns true for its block ID. Blocks in chunks that
+// are not loaded are never set
+occmap_t export_occupancy(extent_t ex, bidpred_t pred) {
+    occmap_t o;
+    lh_clear_obj(o);
+    o.sr = (size3_t) { ex.max.x-ex.min.x+1, ex.max.y-ex.min.y+1, ex.max.z-ex.min.z+1 };
+    o.wpr = (o.sr.x+63)>>6;
+    lh_alloc_num(o.data, o.sr.y*o.sr.z*o.wpr);
+
+    if (pred && pred != occ_lut_pred) {
+        int i;
+        for(i=0; i<4096; i++)
+            occ_lut[i] = pred(i) ? 1 : 0;
+        occ_lut_pred = pred;
+    }
+
+    int32_t Xl=ex.min.x>>4, Xh=ex.max.x>>4;
+    int32_t Zl=ex.min.z>>4, Zh=ex.max.z>>4;
+    int32_t ylo=MAX(ex.min.y,0), yhi=MIN(ex.max.y,255);
+
+    int32_t X,Z,y,z;
+    for(X=Xl; X<=Xh; X++) {
+        // bit position of the chunk's first block in the rows, and the
+        // mask of the chunk row bits that fall within the extent
+        int32_t pos = X*16-ex.min.x;
+        uint32_t clip = 0xffff;
+        if (pos < 0) clip &= 0xffff<<(-pos);
+        if (pos+16 > o.sr.x) clip &= 0xffff>>(pos+16-o.sr.x);
+
+        for(Z=Zl; Z<=Zh; Z++) {
+            gschunk *gc = find_chunk(gs.world, X, Z, 0);
+            if (!gc) continue;
+
+            int32_t zlo=MAX(Z*16,ex.min.z), zhi=MIN(Z*16+15,ex.max.z);
+            for(y=ylo; y<=yhi; y++) {
+                for(z=zlo; z<=zhi; z++) {
+                    bid_t *row = gc->blocks+(y<<8)+((z&15)<<4);
+                    uint32_t bits = (pred ? occ_row_class(row) : occ_row_nonair(row)) & clip;
+                    if (!bits) continue;
+
+                    uint64_t *orow = OCC_ROW(o, y-ex.min.y, z-ex.min.z);
+                    if (pos < 0) {
+                        orow[0] |= bits>>(-pos);
+                    }
+                    else {
+                        int wi = pos>>6, sh = pos&63;
+                        orow[wi] |= (uint64_t)bits<<sh;
+                        if (sh > 48 && wi+1 < o.wpr) orow[wi+1] |= (uint64_t)bits>>(64-sh);
+                    }
+                }
+            }
+        }
+    }
+
+    return o;
+}
+
 // get just a single block value at given coordinates
 bid_t get_block_at(int32_t x, int32_t z, int32_t y) {
     gschunk *gc = find_chunk(gs.world, x>>4, z>>4, 0);
@@ -1133,6 +1492,7 @@ void gs_packet(MCPacket *pkt) {
             //TODO: name
             //TODO: mark players hostile/neutral/friendly depending on the faglist
             e->mdata = clone_metadata(tpkt->meta);
+            egrid_link(C(gs.entity)-1);
         } _GSP;
 
         GSP(SP_SpawnMob) {
@@ -1163,6 +1523,7 @@ void gs_packet(MCPacket *pkt) {
             }
 
             e->mdata = clone_metadata(tpkt->meta);
+            egrid_link(C(gs.entity)-1);
         } _GSP;
 
         GSP(SP_DestroyEntities) {
@@ -1170,8 +1531,7 @@ void gs_packet(MCPacket *pkt) {
             for(i=0; i<tpkt->count; i++) {
                 int idx = find_entity(tpkt->eids[i]);
                 if (idx<0) continue;
-                free_metadata(P(gs.entity)[idx].mdata);
-                lh_arr_delete(GAR(gs.entity),idx);
+                delete_entity(idx);
             }
         } _GSP;
 
@@ -1184,6 +1544,7 @@ void gs_packet(MCPacket *pkt) {
             e->type = ENTITY_OBJECT;
             e->mtype = tpkt->objtype+256; // +256 for object entities
             e->mdata = NULL; // updated separately with SP_EntityMetadata
+            egrid_link(C(gs.entity)-1);
         } _GSP;
 
         GSP(SP_SpawnExperienceOrb) {
@@ -1195,6 +1556,7 @@ void gs_packet(MCPacket *pkt) {
             e->type = ENTITY_OTHER;
             e->mtype = ExperienceOrb;
             e->mdata = NULL;
+            egrid_link(C(gs.entity)-1);
         } _GSP;
 
         GSP(SP_SpawnPainting) {
@@ -1206,6 +1568,7 @@ void gs_packet(MCPacket *pkt) {
             e->type = ENTITY_OTHER;
             e->mtype = Painting;
             e->mdata = NULL;
+            egrid_link(C(gs.entity)-1);
         } _GSP;
 
         GSP(SP_EntityRelMove) {
@@ -1215,6 +1578,7 @@ void gs_packet(MCPacket *pkt) {
             e->x += ((double)tpkt->dx)/4096.0;
             e->y += ((double)tpkt->dy)/4096.0;
             e->z += ((double)tpkt->dz)/4096.0;
+            egrid_move(idx);
         } _GSP;
 
         GSP(SP_EntityLookRelMove) {
@@ -1224,6 +1588,7 @@ void gs_packet(MCPacket *pkt) {
             e->x += ((double)tpkt->dx)/4096.0;
             e->y += ((double)tpkt->dy)/4096.0;
             e->z += ((double)tpkt->dz)/4096.0;
+            egrid_move(idx);
         } _GSP;
 
         GSP(SP_EntityTeleport) {
@@ -1233,6 +1598,7 @@ void gs_packet(MCPacket *pkt) {
             e->x = tpkt->x;
             e->y = tpkt->y;
             e->z = tpkt->z;
+            egrid_move(idx);
         } _GSP;
 
         GSP(SP_EntityMetadata) {
@@ -1244,7 +1610,7 @@ void gs_packet(MCPacket *pkt) {
                 e->mdata = clone_metadata(tpkt->meta);
             }
             else {
-                update_metadata(e->mdata, tpkt->meta);
+                e->mdata = update_metadata(e->mdata, tpkt->meta);
             }
         } _GSP;
 
@@ -1350,7 +1716,7 @@ void gs_packet(MCPacket *pkt) {
 
         GSP(SP_UnloadChunk) {
             if (gs.opt.prune_chunks)
-                remove_chunk(tpkt->X,tpkt->Z);
+                remove_chunk(gs.world,tpkt->X,tpkt->Z);
         } _GSP;
 
         GSP(SP_BlockChange) {
@@ -1688,6 +2054,8 @@ void gs_packet(MCPacket *pkt) {
             gs.inv.wpos = tpkt->bpos;
         } _GSP;
     }
+
+    release_cache_loads();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1708,6 +2076,10 @@ void gs_reset() {
     gs.inv.drag.item = -1;
     gs.inv.windowopen = 0;
 
+    // entity grid is empty
+    for(i=0; i<EGRID_HSIZE; i++)
+        gs.egrid[i] = -1;
+
     gs_used = 1;
 }
 
@@ -1728,6 +2100,10 @@ void gs_destroy() {
     free_chunks(&gs.nether);
     free_chunks(&gs.end);
 
+    ccache_close(gs.overworld.cache);
+    ccache_close(gs.nether.cache);
+    ccache_close(gs.end.cache);
+
     for(i=0; i<C(gs.players); i++) {
         lh_free(P(gs.players)[i].name);
         lh_free(P(gs.players)[i].dispname);
@@ -1735,6 +2111,20 @@ void gs_destroy() {
     lh_arr_free(GAR(gs.players));
 }
 
+// enable the on-disk chunk cache - one file per dimension, named by the
+// given prefix, each limited to maxmb megabytes
+int gs_chunk_cache(const char *prefix, int maxmb) {
+    char path[4096];
+    sprintf(path, "%s_overworld.ccache", prefix);
+    gs.overworld.cache = ccache_open(path, maxmb);
+    sprintf(path, "%s_nether.ccache", prefix);
+    gs.nether.cache = ccache_open(path, maxmb);
+    sprintf(path, "%s_end.ccache", prefix);
+    gs.end.cache = ccache_open(path, maxmb);
+
+    return gs.overworld.cache && gs.nether.cache && gs.end.cache;
+}
+
 int gs_setopt(int optid, int value) {
     switch (optid) {
         case GSOP_PRUNE_CHUNKS:
@@ -1764,6 +2154,10 @@ int gs_setopt(int optid, int value) {
         case GSOP_ZMAX:
             gs.zmax = value;
             break;
+        case GSOP_MAX_MB:
+            gs.opt.max_mb = value;
+            enforce_budget();
+            break;
 
         default:
             LH_ERROR(-1,"Unknown option ID %d\n", optid);
@@ -1782,6 +2176,8 @@ int gs_getopt(int optid) {
             return gs.opt.track_entities;
         case GSOP_TRACK_INVENTORY:
             return gs.opt.track_entities;
+        case GSOP_MAX_MB:
+            return gs.opt.max_mb;
 
         default:
             LH_ERROR(-1,"Unknown option ID %d\n", optid);
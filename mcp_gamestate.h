@@ -17,6 +17,7 @@
 #include "mcp_ids.h"
 #include "mcp_arg.h"
 #include "mcp_types.h"
+#include "mcp_ccache.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -29,6 +30,7 @@
 #define GSOP_ZMIN               7
 #define GSOP_XMAX               8
 #define GSOP_ZMAX               9
+#define GSOP_MAX_MB             10
 
 ////////////////////////////////////////////////////////////////////////////////
 // entity tracking
@@ -57,9 +59,24 @@ typedef struct _entity {
     int      hostile;   // whether marked hostile
     uint64_t lasthit;   // timestamp when this entity was last attacked - for limiting the attack rate
     char     name[256]; // only valid for players
-    metadata *mdata;    // entity metadata
+    metaset *mdata;     // entity metadata
+
+    int32_t  gcx,gcz;   // spatial grid cell the entity is linked into
+    int32_t  gprev;     // previous/next entity index in the grid bucket list, -1 if none
+    int32_t  gnext;
 } entity;
 
+// spatial grid over the tracked entities - horizontal cells of
+// 2^EGRID_SHIFT blocks, hashed into EGRID_HSIZE buckets
+#define EGRID_SHIFT     3
+#define EGRID_HSIZE     1024
+
+// result of an entity range query
+typedef struct {
+    int         idx;    // index in gs.entity
+    double      dist;
+} entity_near;
+
 ////////////////////////////////////////////////////////////////////////////////
 // player list
 
@@ -78,8 +95,20 @@ typedef struct {
     light_t     skylight[32768];
     uint8_t     biome[256];
     nbt_t      *tent;
+    uint16_t    height[256];    // y above the highest non-air block per column, 0 if empty
+    uint64_t    bmask[16];      // block IDs present per section, see BMASK_BIT
+
+    int32_t     X,Z;            // chunk coords
+    uint64_t    stamp;          // last access via find_chunk, for the LRU eviction
+    int32_t     lidx;           // index in the world's chunk list
+    int8_t      cached;         // loaded from the chunk cache, not sent by the server
 } gschunk;
 
+// section summary bit of a block ID. A set bit means the section may contain
+// the block - blocks sharing the bit or removed since the chunk was loaded
+// give false positives, a clear bit means the block is definitely not there
+#define BMASK_BIT(bid)  (1ULL<<((bid)&63))
+
 // chunk coord -> offset within region (1x1 regions, 32x32 chunks, 512x512 blocks)
 #define CC_0(X,Z)   (uint32_t)((((uint64_t)(X))&0x1f)|((((uint64_t)(Z))&0x1f)<<5))
 
@@ -104,8 +133,13 @@ typedef struct {
 
 typedef struct {
     gssreg *sreg[512*512];
+    ccache_t *cache;    // on-disk chunk cache for this dimension, NULL if not used
+    lh_arr_declare(gschunk *, chunks); // all allocated chunks, unordered
 } gsworld;
 
+// chunks within this distance from the player are never evicted
+#define PIN_RADIUS  8
+
 ////////////////////////////////////////////////////////////////////////////////
 
 typedef struct _gamestate {
@@ -119,6 +153,7 @@ typedef struct _gamestate {
         int track_entities;
         int track_inventory;
         int region_limit;
+        int max_mb;             // memory budget for the chunk storage, 0 - unlimited
     } opt;
 
     struct {
@@ -163,6 +198,7 @@ typedef struct _gamestate {
 
     // tracked entities
     lh_arr_declare(entity, entity);
+    int32_t         egrid[EGRID_HSIZE]; // heads of the grid bucket lists, -1 if empty
 
     lh_arr_declare(pli, players);
 
@@ -170,6 +206,11 @@ typedef struct _gamestate {
     gsworld         end;
     gsworld         nether;
     gsworld        *world;
+    uint64_t        chunk_stamp;    // access counter for the chunk LRU
+    int             cache_loads;    // chunks were loaded from the cache since the last budget check
+
+    int             pinned;         // chunks within the pin extent are never evicted
+    extent_t        pin;
 
     int             xmin,zmin,xmax,zmax;
 } gamestate;
@@ -182,14 +223,22 @@ void gs_reset();
 void gs_destroy();
 int  gs_setopt(int optid, int value);
 int  gs_getopt(int optid);
+int  gs_chunk_cache(const char *prefix, int maxmb);
+void gs_pin_extent(extent_t *ex);
 
 void gs_packet(MCPacket *pkt);
 
 void dump_entities();
+int  gs_entities_in_range(double x, double y, double z, double range,
+                          entity_near *res, int max);
 void dump_inventory();
 
 gschunk * find_chunk(gsworld *w, int32_t X, int32_t Z, int allocate);
 cuboid_t export_cuboid_extent(extent_t ex);
+
+// block class predicate for export_occupancy - gets the block ID, meta is not considered
+typedef int (*bidpred_t)(int bid);
+occmap_t export_occupancy(extent_t ex, bidpred_t pred);
 bid_t get_block_at(int32_t x, int32_t z, int32_t y);
 int get_stored_area(gsworld *w, int32_t *Xmin, int32_t *Xmax, int32_t *Zmin, int32_t *Zmax);
 
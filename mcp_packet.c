@@ -2954,6 +2954,18 @@ int restore_rawtype(MCPacket * pkt) {
     return pkt->rawtype;
 }
 
+// name of the packet type in the currently selected protocol
+const char * get_packet_name(int32_t pid) {
+    if (!SUPPORT) return NULL;
+
+    int cl = PCLIENT(pid);
+    int i;
+    for(i=0; i<0x100 && ((SUPPORT[cl][i].pid&0xff) < 0xff); i++)
+        if (SUPPORT[cl][i].pid == pid)
+            return SUPPORT[cl][i].dump_name;
+    return NULL;
+}
+
 MCPacket * decode_packet(int is_client, uint8_t *data, ssize_t len) {
     if (len <= 0) return NULL;  // some servers send empty packets
 
@@ -3050,9 +3062,23 @@ void queue_packet (MCPacket *pkt, MCPacketQueue *q) {
     *lh_arr_new(GAR(q->queue)) = pkt;
 }
 
+// move one packet from the pq to the q, rate-limited by the token bucket.
+// pq is consumed from its head, so a long queue is not moved on every packet
 void packet_queue_transmit(MCPacketQueue *q, MCPacketQueue *pq, tokenbucket *tb) {
     if (!tb_event(tb, 1)) return;
-    if (!C(pq->queue)) return; // no preview packets queued
-    queue_packet(P(pq->queue)[0], q);
-    lh_arr_delete(GAR(pq->queue),0);
+    if (pq->head >= C(pq->queue)) return; // no preview packets queued
+    queue_packet(P(pq->queue)[pq->head++], q);
+
+    if (pq->head == C(pq->queue)) {
+        // all sent - start over at the beginning of the array
+        C(pq->queue) = 0;
+        pq->head = 0;
+    }
+    else if (pq->head >= 64 && pq->head*2 >= C(pq->queue)) {
+        // drop the sent part once it takes more than half of the array
+        memmove(P(pq->queue), P(pq->queue)+pq->head,
+                (C(pq->queue)-pq->head)*sizeof(MCPacket *));
+        C(pq->queue) -= pq->head;
+        pq->head = 0;
+    }
 }
@@ -70,7 +70,7 @@ typedef struct {
     int16_t     vx;
     int16_t     vy;
     int16_t     vz;
-    metadata *meta;
+    metaset *meta;
 } SP_SpawnMob_pkt;
 
 // 0x04
@@ -92,7 +92,7 @@ typedef struct {
     angle_t     yaw;
     angle_t     pitch;
     int16_t     item;
-    metadata *meta;
+    metaset *meta;
 } SP_SpawnPlayer_pkt;
 
 // 0x09
@@ -318,7 +318,7 @@ typedef struct {
 // 0x3c
 typedef struct {
     uint32_t    eid;
-    metadata *  meta;
+    metaset *   meta;
 } SP_EntityMetadata_pkt;
 
 // 0x40
@@ -614,6 +614,7 @@ typedef struct {
 
 typedef struct {
     lh_arr_declare(MCPacket *,queue);
+    ssize_t head;           // first packet not sent yet by packet_queue_transmit
 } MCPacketQueue;
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -624,6 +625,7 @@ int         set_protocol(int protocol, char * reply);
 MCPacket *  decode_packet(int is_client, uint8_t *p, ssize_t len);
 ssize_t     encode_packet(MCPacket *pkt, uint8_t *buf);
 void        dump_packet(MCPacket *pkt);
+const char *get_packet_name(int32_t pid);
 void        free_packet  (MCPacket *pkt);
 void        queue_packet (MCPacket *pkt, MCPacketQueue *q);
 void        packet_queue_transmit(MCPacketQueue *q, MCPacketQueue *pq, tokenbucket *tb);
@@ -0,0 +1,353 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+/*
+ mcp_play : processing of the PLAY state packets - decompression, decoding,
+ passing through gamestate and game modules and encoding the resulting
+ packets into the transmission buffers. Shared by mcproxy and mcpbench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <zlib.h>
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#define LH_DECLARE_SHORT_NAMES 1
+
+#include <lh_debug.h>
+#include <lh_buffers.h>
+#include <lh_bytes.h>
+#include <lh_compress.h>
+#include <lh_arr.h>
+
+#include "mcp_play.h"
+#include "mcp_gamestate.h"
+#include "mcp_game.h"
+#include "mcp_stats.h"
+
+int play_comptr = -1;
+
+////////////////////////////////////////////////////////////////////////////////
+// Packet compression
+
+play_zopt_t play_zopt = {
+    .backend  = ZB_ZLIB,
+    .level    = Z_DEFAULT_COMPRESSION,
+    .strategy = Z_DEFAULT_STRATEGY,
+};
+
+static const char * ZBACKEND_NAMES[] = { "oneshot", "zlib", "libdeflate", NULL };
+
+// indexed by the zlib strategy constants
+static const char * ZSTRATEGY_NAMES[] = { "default", "filtered", "huffman", "rle", "fixed", NULL };
+
+// persistent streams, indexed by direction (is_client)
+static z_stream zs_def[2], zs_inf[2];
+static int      zs_def_active[2], zs_inf_active[2];
+
+#ifdef HAVE_LIBDEFLATE
+static struct libdeflate_compressor   * ld_comp   = NULL;
+static struct libdeflate_decompressor * ld_decomp = NULL;
+#endif
+
+static int zname_lookup(const char **names, const char *name) {
+    int i;
+    for(i=0; names[i]; i++)
+        if (!strcasecmp(names[i], name))
+            return i;
+    return -1;
+}
+
+int play_zbackend_byname(const char *name) {
+    return zname_lookup(ZBACKEND_NAMES, name);
+}
+
+int play_zstrategy_byname(const char *name) {
+    return zname_lookup(ZSTRATEGY_NAMES, name);
+}
+
+const char * play_zbackend_name(int backend) {
+    return ZBACKEND_NAMES[backend];
+}
+
+const char * play_zstrategy_name(int strategy) {
+    return ZSTRATEGY_NAMES[strategy];
+}
+
+// release all compression contexts, they will be recreated on the next use
+void play_zfree() {
+    int dir;
+    for(dir=0; dir<2; dir++) {
+        if (zs_def_active[dir]) deflateEnd(zs_def+dir);
+        if (zs_inf_active[dir]) inflateEnd(zs_inf+dir);
+        zs_def_active[dir] = zs_inf_active[dir] = 0;
+    }
+
+#ifdef HAVE_LIBDEFLATE
+    if (ld_comp) libdeflate_free_compressor(ld_comp);
+    if (ld_decomp) libdeflate_free_decompressor(ld_decomp);
+    ld_comp = NULL;
+    ld_decomp = NULL;
+#endif
+}
+
+int play_zconfig(int backend, int level, int strategy) {
+    if (backend < 0 || backend > ZB_LIBDEFLATE) return 0;
+#ifndef HAVE_LIBDEFLATE
+    if (backend == ZB_LIBDEFLATE) return 0;
+#endif
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) return 0;
+    if (strategy < Z_DEFAULT_STRATEGY || strategy > Z_FIXED) return 0;
+
+    play_zfree();
+    play_zopt.backend  = backend;
+    play_zopt.level    = level;
+    play_zopt.strategy = strategy;
+    return 1;
+}
+
+static ssize_t play_deflate(int dir, uint8_t *src, ssize_t slen, uint8_t *dst, ssize_t dlen) {
+    switch (play_zopt.backend) {
+        case ZB_ONESHOT:
+            return lh_zlib_encode_to(src, slen, dst, dlen);
+
+#ifdef HAVE_LIBDEFLATE
+        case ZB_LIBDEFLATE: {
+            if (!ld_comp) {
+                // libdeflate has no default level and ignores the strategy
+                int level = (play_zopt.level<0) ? 6 : play_zopt.level;
+                ld_comp = libdeflate_alloc_compressor(level);
+                if (!ld_comp) return -1;
+            }
+            size_t clen = libdeflate_zlib_compress(ld_comp, src, slen, dst, dlen);
+            return clen ? (ssize_t)clen : -1;
+        }
+#endif
+    }
+
+    z_stream *zs = zs_def+dir;
+    if (!zs_def_active[dir]) {
+        CLEAR(*zs);
+        if (deflateInit2(zs, play_zopt.level, Z_DEFLATED, 15, 8, play_zopt.strategy) != Z_OK)
+            return -1;
+        zs_def_active[dir] = 1;
+    }
+    else {
+        deflateReset(zs);
+    }
+
+    zs->next_in   = src;
+    zs->avail_in  = slen;
+    zs->next_out  = dst;
+    zs->avail_out = dlen;
+
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) return -1;
+    return zs->total_out;
+}
+
+static ssize_t play_inflate(int dir, uint8_t *src, ssize_t slen, uint8_t *dst, ssize_t dlen) {
+    switch (play_zopt.backend) {
+        case ZB_ONESHOT:
+            return lh_zlib_decode_to(src, slen, dst, dlen);
+
+#ifdef HAVE_LIBDEFLATE
+        case ZB_LIBDEFLATE: {
+            if (!ld_decomp) {
+                ld_decomp = libdeflate_alloc_decompressor();
+                if (!ld_decomp) return -1;
+            }
+            size_t ulen;
+            if (libdeflate_zlib_decompress(ld_decomp, src, slen, dst, dlen, &ulen) != LIBDEFLATE_SUCCESS)
+                return -1;
+            return ulen;
+        }
+#endif
+    }
+
+    z_stream *zs = zs_inf+dir;
+    if (!zs_inf_active[dir]) {
+        CLEAR(*zs);
+        if (inflateInit(zs) != Z_OK)
+            return -1;
+        zs_inf_active[dir] = 1;
+    }
+    else {
+        inflateReset(zs);
+    }
+
+    zs->next_in   = src;
+    zs->avail_in  = slen;
+    zs->next_out  = dst;
+    zs->avail_out = dlen;
+
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END) return -1;
+    return zs->total_out;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void write_packet_raw(uint8_t *ptr, ssize_t len, lh_buf_t *buf) {
+    uint8_t hbuf[16]; CLEAR(hbuf);
+    ssize_t ll = lh_place_varint(hbuf,len) - hbuf;
+
+    ssize_t widx = buf->C(data);
+
+    lh_arr_add(GAR4(buf->data),(len+ll));
+
+    memmove(P(buf->data)+widx, hbuf, ll);
+    memmove(P(buf->data)+widx+ll, ptr, len);
+}
+
+uint8_t ubuf[MCP_MAXPLEN];
+uint8_t cbuf[MCP_MAXPLEN];
+#define LIM64(len) ((len)>64?64:(len))
+#define LIM128(len) ((len)>128?128:(len))
+
+void write_packet(MCPacket *pkt, lh_buf_t *tx) {
+    uint64_t t = st_now();
+    ssize_t ulen = encode_packet(pkt, ubuf);
+    t = st_lap(ST_ENCODE, pkt->pid, t);
+
+    if (play_comptr >= 0) {
+        // compression is active
+        uint8_t *w = cbuf;
+        ssize_t clen = 0;
+        if (ulen >= play_comptr) {
+            // length is at or over threshold - compress it
+            write_varint(w, (int32_t)ulen);
+            clen = play_deflate(pkt->cl, ubuf, ulen, w, cbuf+sizeof(cbuf)-w);
+            assert(clen > 0);
+            st_lap(ST_DEFLATE, pkt->pid, t);
+        }
+        else {
+            // packet is below compression threshold, send uncompressed
+            write_varint(w, 0);
+            memmove(w, ubuf, ulen);
+            clen = ulen;
+        }
+        clen += (w-cbuf);
+        write_packet_raw(cbuf, clen, tx);
+
+#if 0
+        printf("%c P clen=%6zd    ",pkt->cl?'C':'S',clen);
+        hexprint(cbuf, LIM64(clen));
+#endif
+
+    }
+    else {
+        // no compression - simply append the packet to the transmission buffer
+        write_packet_raw(ubuf, ulen, tx);
+#if 0
+        printf("%c P ulen=%6zd    ",pkt->cl?'C':'S',ulen);
+        hexprint(ubuf, LIM64(ulen));
+#endif
+
+    }
+}
+
+void flush_queue(MCPacketQueue *q, lh_buf_t *qx) {
+    int i;
+    for(i=0; i<C(q->queue); i++) {
+        MCPacket * pkt = P(q->queue)[i];
+        write_packet(pkt, qx);
+        free_packet(pkt);
+    }
+    lh_free(P(q->queue));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void process_play_packet(int is_client, struct timeval ts,
+                         uint8_t *ptr, uint8_t *lim,
+                         lh_buf_t *tx, lh_buf_t *bx) {
+
+    char comp=' ';
+
+    uint8_t *raw_ptr = ptr;       // start of the raw packet (with the complen field)
+    //uint8_t *raw_lim = lim;       // limit ptr of the raw data
+    ssize_t  raw_len = lim-ptr;   // and its length
+
+    uint8_t *p       = ptr;       // decoding pointer, after passing the decomp code
+                                  // it should be pointing at the packet type field
+    uint8_t *plim    = lim;       // limit ptr of the packet data
+    ssize_t  plen    = plim-p;    // length of the decompressed data
+
+    uint64_t t = st_now();
+    uint64_t inflate_ns = 0;
+
+    if (play_comptr>=0) {
+        // compression is enabled
+        comp = '.';
+        int32_t usize = lh_read_varint(p); // supposed size of uncompressed data
+
+        if (usize>0) {
+            // packet is compressed - uncompress into temp buffer
+            comp = '*';
+            plen = play_inflate(is_client, p, plim-p, ubuf, usize);
+            if (plen != usize) {
+                printf("Failed to decompress packet, expected %d bytes, zlib returned %zd. Skipping packet. Some decompressed data shown below:\n", usize, plen);
+                hexdump(ubuf, 64);
+                return;
+            }
+            inflate_ns = st_now()-t;
+
+            // correct p and lim to match the decompressed packet
+            p=ubuf;
+            plim = p+plen;
+        }
+        // usize==0 means the packet is not compressed, so in effect we simply
+        // moved the decoding pointer to the start of the actual packet data
+
+        plen = plim-p;
+    }
+
+#if 0
+    printf("%c P  len=%6zd %c  ",is_client?'C':'S',raw_len,comp);
+    hexprint(raw_ptr, LIM64(raw_len));
+#endif
+
+#if 0
+    printf("%c P plen=%6zd    ",is_client?'C':'S',plen,comp);
+    hexprint(p, LIM64(plen));
+#endif
+
+    t = st_now();
+    MCPacket *pkt=decode_packet(is_client, p, plen);
+    if (!pkt) {
+        printf("Failed to decode packet. Some packet data shown below (len=%zd):\n", plen);
+        hexdump(p, (plen<64)?plen:64);
+        return;
+    }
+    pkt->ts = ts;
+
+    // gm_packet may free or forward the packet, so keep the ID for stats
+    int32_t pid = pkt->pid;
+    if (comp=='*') st_record(ST_INFLATE, pid, inflate_ns);
+    t = st_lap(ST_DECODE, pid, t);
+
+    ////////////////////////////////////////////////////////////////////////////
+
+    MCPacketQueue tq = {NULL,0}, bq = {NULL,0};
+
+    // pass the packet to both gamestate and game
+    gs_packet(pkt);
+    t = st_lap(ST_GS, pid, t);
+    gm_packet(pkt, &tq, &bq);
+    st_lap(ST_GM, pid, t);
+
+    // transmit packets in the queues, if any
+    flush_queue(&tq, tx);
+    flush_queue(&bq, bx);
+}
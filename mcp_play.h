@@ -0,0 +1,62 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include <lh_buffers.h>
+
+#include "mcp_packet.h"
+
+// compression threshold, -1 means compression is disabled
+extern int play_comptr;
+
+////////////////////////////////////////////////////////////////////////////////
+// Packet compression
+
+#define ZB_ONESHOT      0   // lh_zlib_* - a new zlib context for every packet
+#define ZB_ZLIB         1   // persistent per-direction z_streams, reset between packets
+#define ZB_LIBDEFLATE   2   // libdeflate whole-buffer compression, if built with HAVE_LIBDEFLATE
+
+typedef struct {
+    int backend;    // ZB_*
+    int level;      // zlib compression level, -1 for the zlib default
+    int strategy;   // Z_DEFAULT_STRATEGY, Z_FILTERED, ... (zlib backend only)
+} play_zopt_t;
+
+extern play_zopt_t play_zopt;
+
+// select the compression backend and parameters, returns 0 if they are invalid
+// or the backend is not available
+int  play_zconfig(int backend, int level, int strategy);
+void play_zfree();
+
+int  play_zbackend_byname(const char *name);
+int  play_zstrategy_byname(const char *name);
+const char * play_zbackend_name(int backend);
+const char * play_zstrategy_name(int strategy);
+
+////////////////////////////////////////////////////////////////////////////////
+
+// append a raw packet with its length prefix to the buffer
+void write_packet_raw(uint8_t *ptr, ssize_t len, lh_buf_t *buf);
+
+// encode and (if needed) compress a packet into the buffer
+void write_packet(MCPacket *pkt, lh_buf_t *tx);
+
+// write out and free all packets in the queue
+void flush_queue(MCPacketQueue *q, lh_buf_t *qx);
+
+// process a single PLAY packet - forwarded data goes to tx, responses to bx
+void process_play_packet(int is_client, struct timeval ts,
+                         uint8_t *ptr, uint8_t *lim,
+                         lh_buf_t *tx, lh_buf_t *bx);
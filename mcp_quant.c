@@ -0,0 +1,189 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#define LH_DECLARE_SHORT_NAMES 1
+
+#include <lh_buffers.h>
+
+#include "mcp_quant.h"
+
+#define QCELL       (256/QLUT_SIZE)
+#define QCELL_IDX(r,g,b) ((((r)/QCELL)*QLUT_SIZE+(g)/QCELL)*QLUT_SIZE+(b)/QCELL)
+
+// amplitude of the ordered dithering noise
+#define QDITHER_SPREAD  32.0f
+
+static inline float qdist2(qcolor_t *p, float r, float g, float b) {
+    float dr = p->r-r, dg = p->g-g, db = p->b-b;
+    return dr*dr+dg*dg+db*db;
+}
+
+quant_t * quant_create(qcolor_t *pal, int npal) {
+    lh_create_obj(quant_t, q);
+    lh_alloc_num(q->pal, npal);
+    memmove(q->pal, pal, npal*sizeof(qcolor_t));
+    q->npal = npal;
+
+    // every color in a cell is at most this far from the cell center
+    float rad = (QCELL-1)/2.0f*sqrtf(3.0f);
+
+    lh_create_num(float, d, npal);
+    int r,g,b,i;
+    for(r=0; r<QLUT_SIZE; r++) {
+        for(g=0; g<QLUT_SIZE; g++) {
+            for(b=0; b<QLUT_SIZE; b++) {
+                float cr = r*QCELL+(QCELL-1)/2.0f;
+                float cg = g*QCELL+(QCELL-1)/2.0f;
+                float cb = b*QCELL+(QCELL-1)/2.0f;
+
+                int best = 0;
+                for(i=0; i<npal; i++) {
+                    d[i] = sqrtf(qdist2(pal+i, cr, cg, cb));
+                    if (d[i] < d[best]) best = i;
+                }
+
+                // an entry can only be nearest to a color in this cell
+                // if it's not farther from the center than the best
+                // one by more than the cell diameter
+                float limit = d[best]+2*rad+0.01f;
+                int ncand = 0;
+                for(i=0; i<npal; i++)
+                    ncand += (d[i] <= limit);
+
+                int32_t *e = q->lut+(r*QLUT_SIZE+g)*QLUT_SIZE+b;
+                if (ncand == 1) {
+                    *e = best;
+                    continue;
+                }
+
+                *e = -(int32_t)C(q->cand)-1;
+                for(i=0; i<npal; i++)
+                    if (d[i] <= limit)
+                        *lh_arr_new(GAR(q->cand)) = i;
+                *lh_arr_new(GAR(q->cand)) = -1;
+            }
+        }
+    }
+    lh_free(d);
+
+    return q;
+}
+
+void quant_free(quant_t *q) {
+    if (!q) return;
+    lh_free(q->pal);
+    lh_arr_free(GAR(q->cand));
+    lh_free(q);
+}
+
+int quant_color(quant_t *q, uint32_t c) {
+    int r = (c>>16)&0xff, g = (c>>8)&0xff, b = c&0xff;
+
+    int32_t e = q->lut[QCELL_IDX(r,g,b)];
+    if (e >= 0) return e;
+
+    // ambiguous cell - exact search over the candidates
+    int16_t *cand = P(q->cand)-e-1;
+    int best = cand[0];
+    float bd = qdist2(q->pal+best, r, g, b);
+    for(cand++; *cand>=0; cand++) {
+        float dd = qdist2(q->pal+*cand, r, g, b);
+        if (dd < bd) { best = *cand; bd = dd; }
+    }
+    return best;
+}
+
+static inline int clamp8(float v) {
+    return (v<0) ? 0 : (v>255) ? 255 : (int)(v+0.5f);
+}
+
+static const uint8_t BAYER4[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+void quant_image(quant_t *q, uint32_t *pixels, int width, int height, int stride,
+                 int dither, int16_t *out) {
+    int x,y;
+
+    // error diffusion buffers for the current and the next row,
+    // with one extra pixel on each side
+    float (*err)[3] = NULL, (*nerr)[3] = NULL;
+    if (dither == QDITHER_FS) {
+        lh_alloc_num(err, width+2);
+        lh_alloc_num(nerr, width+2);
+    }
+
+    for(y=0; y<height; y++) {
+        uint32_t *row = pixels+y*stride;
+        int16_t *orow = out+y*width;
+
+        for(x=0; x<width; x++) {
+            uint32_t p = row[x];
+            if (p&0xff000000) {
+                orow[x] = -1;
+                continue;
+            }
+
+            float r = (p>>16)&0xff, g = (p>>8)&0xff, b = p&0xff;
+            switch (dither) {
+                case QDITHER_ORDERED: {
+                    float t = (BAYER4[y&3][x&3]/16.0f-0.5f)*QDITHER_SPREAD;
+                    r += t; g += t; b += t;
+                    break;
+                }
+                case QDITHER_FS:
+                    r += err[x+1][0];
+                    g += err[x+1][1];
+                    b += err[x+1][2];
+                    break;
+            }
+
+            int idx = quant_color(q, (clamp8(r)<<16)|(clamp8(g)<<8)|clamp8(b));
+            orow[x] = idx;
+
+            if (dither == QDITHER_FS) {
+                float e[3] = { r-q->pal[idx].r, g-q->pal[idx].g, b-q->pal[idx].b };
+                int i;
+                for(i=0; i<3; i++) {
+                    err[x+2][i]  += e[i]*7/16;
+                    nerr[x][i]   += e[i]*3/16;
+                    nerr[x+1][i] += e[i]*5/16;
+                    nerr[x+2][i] += e[i]*1/16;
+                }
+            }
+        }
+
+        if (dither == QDITHER_FS) {
+            float (*t)[3] = err;
+            err = nerr;
+            nerr = t;
+            lh_clear_num(nerr, width+2);
+        }
+    }
+
+    lh_free(err);
+    lh_free(nerr);
+}
+
+int quant_dither_mode(const char *name) {
+    if (!name || !name[0] || !strcasecmp(name, "none"))  return QDITHER_NONE;
+    if (!strcasecmp(name, "ordered"))                    return QDITHER_ORDERED;
+    if (!strcasecmp(name, "fs") || !strcasecmp(name, "floyd")) return QDITHER_FS;
+    return -1;
+}
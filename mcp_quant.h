@@ -0,0 +1,61 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+#pragma once
+
+/*
+ mcp_quant : color quantization to a fixed palette
+
+ The RGB space is split into QLUT_SIZE^3 cells. Every cell stores either
+ the palette entry that is nearest to all colors in the cell, or a short
+ list of the entries that can be nearest to some color in it, which is
+ then searched exactly. The result is always identical to a full search
+ over the palette, with ties resolved to the lower palette index
+*/
+
+#include <stdint.h>
+
+#include <lh_arr.h>
+
+#define QLUT_BITS   5
+#define QLUT_SIZE   (1<<QLUT_BITS)
+
+// dithering modes for quant_image
+#define QDITHER_NONE    0
+#define QDITHER_ORDERED 1   // 4x4 Bayer matrix
+#define QDITHER_FS      2   // Floyd-Steinberg error diffusion
+
+typedef struct {
+    float       r,g,b;
+} qcolor_t;
+
+typedef struct {
+    qcolor_t   *pal;        // palette colors
+    int         npal;
+
+    // per cell: palette index if >=0, otherwise -(offset+1) of a
+    // -1 terminated candidate list in cand
+    int32_t     lut[QLUT_SIZE*QLUT_SIZE*QLUT_SIZE];
+    lh_arr_declare(int16_t, cand);
+} quant_t;
+
+quant_t * quant_create(qcolor_t *pal, int npal);
+void quant_free(quant_t *q);
+
+// palette index nearest to a 0xRRGGBB color
+int quant_color(quant_t *q, uint32_t c);
+
+// quantize an image with 0xAARRGGBB pixels into palette indices.
+// Pixels with a non-zero alpha byte are transparent and result in -1
+void quant_image(quant_t *q, uint32_t *pixels, int width, int height, int stride,
+                 int dither, int16_t *out);
+
+// parse a dithering mode name, -1 if not recognized
+int quant_dither_mode(const char *name);
@@ -0,0 +1,178 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LH_DECLARE_SHORT_NAMES 1
+
+#include <lh_buffers.h>
+
+#include "mcp_stats.h"
+#include "mcp_ids.h"
+#include "mcp_packet.h"
+
+int st_enabled = 1;
+
+static const char * STAGE_NAMES[ST_NUM] = {
+    "recv", "decrypt", "framing", "inflate", "decode", "gs",
+    "gm", "encode", "deflate", "encrypt", "send",
+};
+
+// totals per stage
+static st_hist st_total[ST_NUM];
+
+// per-packet-type histograms, allocated on first use
+// indexed by [is_client][packet type]
+static st_hist * st_pertype[2][MAXPACKETTYPES];
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint64_t st_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000+(uint64_t)ts.tv_nsec;
+}
+
+static inline int st_bucket(uint64_t v) {
+    if (v < ST_SUBCOUNT) return (int)v;
+
+    int e = 63-__builtin_clzll(v); // position of the highest bit
+    if (e > ST_MAXBITS) return ST_NBUCKETS-1;
+
+    int sub = (v>>(e-ST_SUBBITS))&(ST_SUBCOUNT-1);
+    return (e-ST_SUBBITS+1)*ST_SUBCOUNT+sub;
+}
+
+// middle of the value range covered by a bucket
+static inline uint64_t st_bucket_value(int idx) {
+    if (idx < ST_SUBCOUNT) return idx;
+
+    int g = idx/ST_SUBCOUNT;
+    int sub = idx%ST_SUBCOUNT;
+    uint64_t lo = (uint64_t)(ST_SUBCOUNT+sub)<<(g-1);
+    return lo + (((uint64_t)1<<(g-1))>>1);
+}
+
+static inline void st_hist_add(st_hist *h, uint64_t ns) {
+    if (h->count==0 || ns<h->min) h->min = ns;
+    if (ns>h->max) h->max = ns;
+    h->count++;
+    h->sum += ns;
+    h->bucket[st_bucket(ns)]++;
+}
+
+void st_record(int stage, int32_t pid, uint64_t ns) {
+    if (!st_enabled) return;
+
+    st_hist_add(st_total+stage, ns);
+
+    if (pid < 0) return;
+
+    st_hist **pt = &st_pertype[PCLIENT(pid)][PID(pid)&(MAXPACKETTYPES-1)];
+    if (!*pt) lh_alloc_num(*pt, ST_NUM);
+    st_hist_add((*pt)+stage, ns);
+}
+
+uint64_t st_lap(int stage, int32_t pid, uint64_t ts) {
+    uint64_t now = st_now();
+    st_record(stage, pid, now-ts);
+    return now;
+}
+
+st_hist * st_get(int stage, int32_t pid) {
+    st_hist *pt = st_pertype[PCLIENT(pid)][PID(pid)&(MAXPACKETTYPES-1)];
+    return (pt && pt[stage].count) ? pt+stage : NULL;
+}
+
+uint64_t st_percentile(st_hist *h, double pct) {
+    if (!h->count) return 0;
+
+    uint64_t target = (uint64_t)(h->count*pct/100.0);
+    if (target >= h->count) target = h->count-1;
+
+    uint64_t seen = 0;
+    int i;
+    for(i=0; i<ST_NBUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen > target) {
+            uint64_t v = st_bucket_value(i);
+            return (v>h->max) ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+void st_reset() {
+    CLEAR(st_total);
+
+    int cl,t;
+    for(cl=0; cl<2; cl++)
+        for(t=0; t<MAXPACKETTYPES; t++)
+            lh_free(st_pertype[cl][t]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define US(ns) ((double)(ns)/1000.0)
+
+static void st_dump_hist(const char *name, st_hist *h) {
+    printf("  %-28s %9jd %10.1f %8.1f %8.1f %8.1f %8.1f %10.1f\n",
+           name, (intmax_t)h->count, US(h->sum)/1000.0, US(h->sum/h->count),
+           US(st_percentile(h, 50.0)), US(st_percentile(h, 90.0)),
+           US(st_percentile(h, 99.0)), US(h->max));
+}
+
+void st_dump(int pertype) {
+    printf("Packet path latency (times in us, total in ms):\n");
+    printf("  %-28s %9s %10s %8s %8s %8s %8s %10s\n",
+           "stage", "count", "total", "avg", "p50", "p90", "p99", "max");
+
+    int s,cl,t;
+    for(s=0; s<ST_NUM; s++) {
+        st_hist *h = st_total+s;
+        if (!h->count) continue;
+        st_dump_hist(STAGE_NAMES[s], h);
+    }
+
+    if (!pertype) return;
+
+    for(cl=0; cl<2; cl++) {
+        for(t=0; t<MAXPACKETTYPES; t++) {
+            st_hist *pt = st_pertype[cl][t];
+            if (!pt) continue;
+
+            int32_t pid = ((cl?0x13:0x03)<<24)|t;
+            const char *pname = get_packet_name(pid);
+            printf("%c %02x %s\n", cl?'C':'S', t, pname?pname:"Unknown");
+
+            for(s=0; s<ST_NUM; s++) {
+                if (!pt[s].count) continue;
+                st_dump_hist(STAGE_NAMES[s], pt+s);
+            }
+        }
+    }
+}
+
+// short per-stage summary suitable for a chat message
+int st_summary(char *buf) {
+    int pos = 0, s;
+    for(s=0; s<ST_NUM; s++) {
+        st_hist *h = st_total+s;
+        if (!h->count) continue;
+        pos += sprintf(buf+pos, "%s%s:%.0f/%.0f", pos?" ":"", STAGE_NAMES[s],
+                       US(st_percentile(h, 50.0)), US(st_percentile(h, 99.0)));
+    }
+    if (!pos) pos = sprintf(buf, "No measurements");
+    return pos;
+}
@@ -0,0 +1,78 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+#pragma once
+
+/*
+ mcp_stats : latency instrumentation for the proxy packet path
+*/
+
+#include <stdint.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Processing stages
+
+#define ST_RECV         0   // socket I/O in the event loop, outside handle_proxy
+#define ST_DECRYPT      1   // AES decryption of the incoming data
+#define ST_FRAMING      2   // packet boundary detection, .mcs capture, rx buffer shifting
+#define ST_INFLATE      3   // zlib decompression of a single packet
+#define ST_DECODE       4   // decode_packet
+#define ST_GS           5   // gs_packet
+#define ST_GM           6   // gm_packet
+#define ST_ENCODE       7   // encode_packet
+#define ST_DEFLATE      8   // zlib compression of a single packet
+#define ST_ENCRYPT      9   // AES encryption of the outgoing data
+#define ST_SEND         10  // lh_conn_write
+#define ST_NUM          11
+
+////////////////////////////////////////////////////////////////////////////////
+// Histograms
+
+// HDR-style log-linear buckets: values below 2^ST_SUBBITS are counted
+// exactly, above that each power of two is split into 2^ST_SUBBITS
+// linear sub-buckets, so the relative error stays below 1/2^ST_SUBBITS
+#define ST_SUBBITS      3
+#define ST_SUBCOUNT     (1<<ST_SUBBITS)
+#define ST_MAXBITS      44  // ~4.8 hours in ns - everything above is clamped
+#define ST_NBUCKETS     ((ST_MAXBITS-ST_SUBBITS+2)*ST_SUBCOUNT)
+
+typedef struct {
+    uint64_t    count;
+    uint64_t    sum;        // total ns
+    uint64_t    min;
+    uint64_t    max;
+    uint32_t    bucket[ST_NBUCKETS];
+} st_hist;
+
+////////////////////////////////////////////////////////////////////////////////
+
+extern int st_enabled;
+
+// monotonic timestamp in ns
+uint64_t st_now();
+
+// record a single measurement for a stage. pid is the packet ID
+// (as in mcp_ids.h) for the per-packet stages, or -1 if the measurement
+// is not attributable to a single packet
+void st_record(int stage, int32_t pid, uint64_t ns);
+
+// record the time elapsed since ts and return the current timestamp,
+// so consecutive stages can be chained
+uint64_t st_lap(int stage, int32_t pid, uint64_t ts);
+
+// histogram of a stage for the given packet type, NULL if nothing was recorded
+st_hist * st_get(int stage, int32_t pid);
+
+// value at the given percentile (0..100) in ns
+uint64_t st_percentile(st_hist *h, double pct);
+
+void st_reset();
+void st_dump(int pertype);
+int  st_summary(char *buf);
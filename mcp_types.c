@@ -51,6 +51,10 @@ void free_cuboid(cuboid_t c) {
             free(c.data[y]);
 }
 
+void free_occmap(occmap_t o) {
+    if (o.data) free(o.data);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // String
 
@@ -170,3 +170,17 @@ typedef struct {
 
 void free_cuboid(cuboid_t c);
 
+// bit-packed occupancy of a block volume - one bit per block, set if the
+// block belongs to the selected block class. Rows along x are packed into
+// 64-bit words, bit n of a row is the block at x = min.x+n
+typedef struct {
+    uint64_t * data;    // sr.y slices of sr.z rows, wpr words each
+    size3_t sr;         // size of the volume in blocks
+    int32_t wpr;        // words per row
+} occmap_t;
+
+#define OCC_ROW(o,y,z)   ((o).data+((y)*(o).sr.z+(z))*(o).wpr)
+#define OCC_GET(o,x,y,z) ((OCC_ROW(o,y,z)[(x)>>6]>>((x)&63))&1)
+
+void free_occmap(occmap_t o);
+
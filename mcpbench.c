@@ -0,0 +1,593 @@
+/*
+ Authors:
+ Copyright 2012-2015 by Eduard Broese <ed.broese@gmx.de>
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version
+ 2 of the License, or (at your option) any later version.
+*/
+
+/*
+ mcpbench : replay .mcs captures through the PLAY packet path of mcproxy
+ (process_play_packet -> gs_packet -> gm_packet -> flush_queue) with
+ in-memory output buffers instead of sockets, and report the throughput,
+ number of allocations and the time spent in each processing stage
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define LH_DECLARE_SHORT_NAMES 1
+
+#include <lh_debug.h>
+#include <lh_arr.h>
+#include <lh_buffers.h>
+#include <lh_bytes.h>
+#include <lh_files.h>
+
+#include "mcp_ids.h"
+#include "mcp_packet.h"
+#include "mcp_gamestate.h"
+#include "mcp_game.h"
+#include "mcp_play.h"
+#include "mcp_stats.h"
+#include "hud.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// fake drop_connection function to make mcpbench not dependent on mcproxy.c
+void drop_connection() {
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation counters
+// mcpbench is linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+// so every allocation made in the packet path, including libhelper, ends up here
+
+uint64_t nalloc   = 0;
+uint64_t nrealloc = 0;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t nmemb, size_t size);
+void * __real_realloc(void *ptr, size_t size);
+
+void * __wrap_malloc(size_t size) {
+    nalloc++;
+    return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t nmemb, size_t size) {
+    nalloc++;
+    return __real_calloc(nmemb, size);
+}
+
+void * __wrap_realloc(void *ptr, size_t size) {
+    if (ptr) nrealloc++; else nalloc++;
+    return __real_realloc(ptr, size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int o_help          = 0;
+int o_iterations    = 1;
+int o_async         = 0;
+int o_pertype       = 0;
+int o_compare       = 0;
+int o_export        = 0;
+int o_tunnel        = 0;
+int o_zbackend      = ZB_ZLIB;
+int o_zlevel        = -1;
+int o_zstrategy     = 0;
+
+void print_usage() {
+    printf("Usage:\n"
+           "mcpbench [options] file.mcs...\n"
+           "  -h                        : print this help\n"
+           "  -n iterations             : replay each file this many times, default 1\n"
+           "  -a                        : also run gm_async after each packet (build, HUD, autokill...)\n"
+           "  -t                        : show per-packet-type statistics\n"
+           "  -b backend                : compression backend: oneshot, zlib (default) or libdeflate\n"
+           "  -z level                  : compression level, -1..9, default -1 (zlib default)\n"
+           "  -s strategy               : zlib strategy: default, filtered, huffman, rle or fixed\n"
+           "  -c                        : compare compression CPU time per packet type against oneshot\n"
+           "  -e                        : benchmark block exports (cuboid vs. occupancy bitmap)\n"
+           "                              around the final player position\n"
+           "  -r                        : check the tunnel radar against a brute-force stencil,\n"
+           "                              around the final player position and on random data\n"
+    );
+}
+
+int parse_args(int ac, char **av) {
+    int opt,error=0;
+
+    while ( (opt=getopt(ac,av,"n:b:z:s:ahtcer")) != -1 ) {
+        switch (opt) {
+            case 'h':
+                o_help = 1;
+                break;
+            case 'n':
+                if (sscanf(optarg, "%d", &o_iterations)!=1 || o_iterations<1) {
+                    printf("-n : number of iterations must be a positive number\n");
+                    error++;
+                }
+                break;
+            case 'a':
+                o_async = 1;
+                break;
+            case 't':
+                o_pertype = 1;
+                break;
+            case 'c':
+                o_compare = 1;
+                break;
+            case 'e':
+                o_export = 1;
+                break;
+            case 'r':
+                o_tunnel = 1;
+                break;
+            case 'b':
+                if ((o_zbackend=play_zbackend_byname(optarg)) < 0) {
+                    printf("-b : unknown compression backend %s\n", optarg);
+                    error++;
+                }
+                break;
+            case 'z':
+                if (sscanf(optarg, "%d", &o_zlevel)!=1 || o_zlevel<-1 || o_zlevel>9) {
+                    printf("-z : compression level must be -1..9\n");
+                    error++;
+                }
+                break;
+            case 's':
+                if ((o_zstrategy=play_zstrategy_byname(optarg)) < 0) {
+                    printf("-s : unknown zlib strategy %s\n", optarg);
+                    error++;
+                }
+                break;
+            case '?': {
+                printf("Unknown option -%c", opt);
+                error++;
+                break;
+            }
+        }
+    }
+
+    if (!av[optind]) error++;
+
+    return error==0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct {
+    uint64_t    npackets;   // PLAY packets processed
+    uint64_t    bytes_in;   // raw packet data read from the capture
+    uint64_t    bytes_out;  // data written to the output buffers
+} bench_t;
+
+// move everything written to the sink into the byte counter
+static inline void drain(lh_buf_t *sink, bench_t *b) {
+    b->bytes_out += C(sink->data);
+    C(sink->data) = sink->ridx = 0;
+}
+
+void replay_mcs(uint8_t *data, ssize_t size, bench_t *b) {
+    int state = STATE_IDLE;
+    play_comptr = -1;
+
+    // in-memory replacements for mitm.ms_tx and mitm.cs_tx
+    lh_buf_t to_client, to_server;
+    CLEAR(to_client);
+    CLEAR(to_server);
+
+    uint8_t *hdr = data;
+    while(hdr-data <= size-16) {
+        uint8_t *p = hdr;
+
+        int is_client = read_int(p);
+        int sec       = read_int(p);
+        int usec      = read_int(p);
+        int len       = read_int(p);
+
+        uint8_t *lim = p+len;
+        if (lim > data+size) { printf("incomplete packet\n"); break; }
+
+        if (state == STATE_PLAY) {
+            struct timeval tv = { .tv_sec = sec, .tv_usec = usec };
+            lh_buf_t *tx = is_client ? &to_server : &to_client;
+            lh_buf_t *bx = is_client ? &to_client : &to_server;
+
+            process_play_packet(is_client, tv, p, lim, tx, bx);
+
+            if (o_async) {
+                MCPacketQueue sq = {NULL,0}, cq = {NULL,0};
+                gm_async(&sq, &cq);
+
+                flush_queue(&sq, &to_server);
+                flush_queue(&cq, &to_client);
+            }
+
+            b->npackets++;
+            b->bytes_in += len;
+            drain(&to_client, b);
+            drain(&to_server, b);
+        }
+        else {
+            // handshake and login - we only need to follow the state,
+            // the protocol version and the compression threshold
+            if (play_comptr>=0) lh_read_varint(p);
+
+            uint32_t type = lh_read_varint(p);
+            uint32_t stype = ((state<<24)|(is_client<<28)|(type&0xffffff));
+
+            switch (stype) {
+                case CI_Handshake: {
+                    CI_Handshake_pkt tpkt;
+                    decode_handshake(&tpkt, p);
+                    state = tpkt.nextState;
+                    if (state == STATE_LOGIN && !set_protocol(tpkt.protocolVer, NULL)) {
+                        printf("Unsupported protocol version %d\n", tpkt.protocolVer);
+                        hdr = data+size;
+                        continue;
+                    }
+                    break;
+                }
+                case SL_SetCompression:
+                    play_comptr = lh_read_varint(p);
+                    break;
+                case SL_LoginSuccess:
+                    state = STATE_PLAY;
+                    break;
+            }
+        }
+
+        hdr += 16+len; // advance header pointer to the next packet
+    }
+
+    lh_free(P(to_client.data));
+    lh_free(P(to_server.data));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define MB(x) ((double)(x)/1048576.0)
+
+// replay the capture o_iterations times, returns the elapsed time in ns
+uint64_t run_replay(uint8_t *data, ssize_t size, bench_t *b) {
+    uint64_t elapsed = 0;
+
+    int i;
+    for(i=0; i<o_iterations; i++) {
+        // start every iteration with a fresh session, like handle_server does
+        gs_reset();
+        gs_setopt(GSOP_PRUNE_CHUNKS, 1);
+        gs_setopt(GSOP_SEARCH_SPAWNERS, 1);
+        gs_setopt(GSOP_TRACK_ENTITIES, 1);
+        gs_setopt(GSOP_TRACK_INVENTORY, 1);
+        gm_reset();
+
+        uint64_t t = st_now();
+        replay_mcs(data, size, b);
+        elapsed += st_now()-t;
+    }
+
+    return elapsed;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Compression backend comparison
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;   // ns
+} zcost_t;
+
+// compression cost per packet type with the oneshot backend
+// indexed by [is_client][packet type]
+zcost_t zbase[2][MAXPACKETTYPES];
+
+static zcost_t get_zcost(int32_t pid) {
+    zcost_t c = { 0, 0 };
+    st_hist *d = st_get(ST_DEFLATE, pid);
+    st_hist *i = st_get(ST_INFLATE, pid);
+    if (d) { c.count += d->count; c.sum += d->sum; }
+    if (i) { c.count += i->count; c.sum += i->sum; }
+    return c;
+}
+
+void save_zcost() {
+    int cl,t;
+    for(cl=0; cl<2; cl++)
+        for(t=0; t<MAXPACKETTYPES; t++)
+            zbase[cl][t] = get_zcost(((cl?0x13:0x03)<<24)|t);
+}
+
+void compare_zcost() {
+    printf("Compression CPU per packet type, %s vs. oneshot (us per packet):\n",
+           play_zbackend_name(play_zopt.backend));
+    printf("  %-36s %9s %9s %9s %9s %10s\n",
+           "packet", "count", "oneshot", play_zbackend_name(play_zopt.backend),
+           "saved", "total ms");
+
+    double saved_total = 0;
+    int cl,t;
+    for(cl=0; cl<2; cl++) {
+        for(t=0; t<MAXPACKETTYPES; t++) {
+            int32_t pid = ((cl?0x13:0x03)<<24)|t;
+            zcost_t o = zbase[cl][t];
+            zcost_t n = get_zcost(pid);
+            if (!o.count || !n.count) continue;
+
+            double ou = (double)o.sum/o.count/1000.0;
+            double nu = (double)n.sum/n.count/1000.0;
+            double saved = (double)o.sum/1000000.0 - (double)n.sum/1000000.0;
+            saved_total += saved;
+
+            const char *pname = get_packet_name(pid);
+            char buf[256];
+            sprintf(buf, "%c %02x %s", cl?'C':'S', t, pname?pname:"Unknown");
+            printf("  %-36s %9jd %9.2f %9.2f %9.2f %10.1f\n",
+                   buf, (intmax_t)n.count, ou, nu, ou-nu, saved);
+        }
+    }
+    printf("  total saved: %.1f ms\n", saved_total);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Block export comparison
+
+#define EXPORT_REPS 100
+
+static int opaque_block(int bid) {
+    return (ITEMS[bid].flags&I_OPAQUE) != 0;
+}
+
+static int64_t count_cuboid(cuboid_t c) {
+    int64_t n = 0;
+    int x,y,z;
+    for(y=0; y<c.sr.y; y++)
+        for(z=0; z<c.sr.z; z++) {
+            bid_t *row = c.data[y]+c.boff+z*c.sa.x;
+            for(x=0; x<c.sr.x; x++)
+                n += (row[x].bid != 0);
+        }
+    return n;
+}
+
+static int64_t count_occmap(occmap_t o) {
+    int64_t n = 0;
+    int i;
+    for(i=0; i<o.sr.y*o.sr.z*o.wpr; i++)
+        n += __builtin_popcountll(o.data[i]);
+    return n;
+}
+
+void bench_export() {
+    int32_t x = (int32_t)floor(gs.own.x);
+    int32_t y = (int32_t)floor(gs.own.y);
+    int32_t z = (int32_t)floor(gs.own.z);
+
+    struct {
+        const char *name;
+        extent_t    ex;
+    } exts[] = {
+        { "map",      { { x-80, y-12, z-80 }, { x+80, y+3,  z+80 } } },
+        { "tunnel",   { { x-80, y-2,  z-80 }, { x+80, y+2,  z+80 } } },
+        { "column",   { { x-32, 0,    z-32 }, { x+31, 255,  z+31 } } },
+        { NULL },
+    };
+
+    printf("Block export around %d,%d,%d (us per export, %d repetitions):\n", x, y, z, EXPORT_REPS);
+    printf("  %-8s %10s %10s %10s %10s %10s %10s\n",
+           "extent", "cuboid", "occupancy", "opaque", "cub. KB", "occ. KB", "blocks");
+
+    int i,r;
+    for(i=0; exts[i].name; i++) {
+        extent_t ex = exts[i].ex;
+        ex.min.y = MAX(ex.min.y, 0);
+        ex.max.y = MIN(ex.max.y, 255);
+
+        uint64_t t = st_now();
+        for(r=0; r<EXPORT_REPS; r++)
+            free_cuboid(export_cuboid_extent(ex));
+        uint64_t tc = st_now()-t;
+
+        t = st_now();
+        for(r=0; r<EXPORT_REPS; r++)
+            free_occmap(export_occupancy(ex, NULL));
+        uint64_t to = st_now()-t;
+
+        t = st_now();
+        for(r=0; r<EXPORT_REPS; r++)
+            free_occmap(export_occupancy(ex, opaque_block));
+        uint64_t tp = st_now()-t;
+
+        // both paths must agree on the number of non-air blocks
+        cuboid_t c = export_cuboid_extent(ex);
+        occmap_t o = export_occupancy(ex, NULL);
+        int64_t nc = count_cuboid(c), no = count_occmap(o);
+
+        printf("  %-8s %10.1f %10.1f %10.1f %10.1f %10.1f %10jd%s\n", exts[i].name,
+               (double)tc/EXPORT_REPS/1000.0, (double)to/EXPORT_REPS/1000.0,
+               (double)tp/EXPORT_REPS/1000.0,
+               (double)c.sa.x*c.sa.y*c.sa.z*sizeof(bid_t)/1024.0,
+               (double)o.sr.y*o.sr.z*o.wpr*sizeof(uint64_t)/1024.0,
+               (intmax_t)no, (nc==no) ? "" : " MISMATCH");
+
+        free_cuboid(c);
+        free_occmap(o);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tunnel radar check
+
+#define TUNNEL_RUNS 24
+
+static int tunnel_occupied(int32_t x, int32_t y, int32_t z) {
+    if (y<0 || y>255) return 0;
+    return get_block_at(x,z,y).bid != 0;
+}
+
+// reference tunnel radar - the stencil evaluated block by block,
+// as the HUD did before the occupancy counts and prefix sums
+static void tunnel_reference(int32_t x, int32_t y, int32_t z, int16_t *radar) {
+    int r,c,i,j;
+    for(r=0; r<128; r++) {
+        for(c=0; c<128; c++) {
+            int32_t bx = x-64+c, bz = z-64+r;
+            int s1=0, s2=0;
+            for(i=-8; i<8; i++) {
+                for(j=y-2; j<=y+2; j++) {
+                    s1 +=   tunnel_occupied(bx-1,j,bz+i)
+                        - 2*tunnel_occupied(bx,  j,bz+i)
+                        +   tunnel_occupied(bx+1,j,bz+i);
+                    s2 +=   tunnel_occupied(bx+i,j,bz-1)
+                        - 2*tunnel_occupied(bx+i,j,bz  )
+                        +   tunnel_occupied(bx+i,j,bz+1);
+                }
+            }
+            radar[r*128+c] = MAX(s1,s2);
+        }
+    }
+}
+
+// fill the layers around y with random blocks of the given density (%),
+// leaving some of the chunks unloaded
+static void tunnel_random_world(int32_t x, int32_t y, int32_t z, int density) {
+    int32_t X,Z;
+    for(Z=(z-80)>>4; Z<=(z+80)>>4; Z++) {
+        for(X=(x-80)>>4; X<=(x+80)>>4; X++) {
+            if (rand()%8 == 0) continue;
+            gschunk *gc = find_chunk(gs.world, X, Z, 1);
+            if (!gc) continue;
+
+            int i,yy;
+            for(yy=MAX(y-3,0); yy<=MIN(y+3,255); yy++)
+                for(i=0; i<256; i++)
+                    gc->blocks[(yy<<8)+i] = BLOCKTYPE((rand()%100 < density), 0);
+        }
+    }
+}
+
+void check_tunnel() {
+    static int16_t fast[128*128], ref[128*128];
+    int run, bad=0;
+
+    srand(1);
+    printf("Tunnel radar check:\n");
+    for(run=0; run<=TUNNEL_RUNS; run++) {
+        int32_t x,y,z;
+        if (run == 0) {
+            // the replayed world
+            x = (int32_t)floor(gs.own.x);
+            y = (int32_t)floor(gs.own.y);
+            z = (int32_t)floor(gs.own.z);
+        }
+        else {
+            // random data far away from it, including the top and bottom of the world
+            x = 1000000+run*1000+rand()%32-16;
+            z = -1000000-run*1000+rand()%32-16;
+            switch (run%4) {
+                case 0:  y = rand()%3; break;
+                case 1:  y = 253+rand()%3; break;
+                default: y = rand()%256; break;
+            }
+            tunnel_random_world(x, y, z, run*100/TUNNEL_RUNS);
+        }
+
+        hud_tunnel_radar(x, y, z, fast);
+        tunnel_reference(x, y, z, ref);
+
+        int i, nd=0;
+        for(i=0; i<128*128; i++)
+            nd += (fast[i] != ref[i]);
+        printf("  %-6s %8d,%3d,%8d : %5d of %d pixels differ\n",
+               run ? "random" : "replay", x, y, z, nd, 128*128);
+        bad += (nd > 0);
+    }
+    printf("  %s\n", bad ? "MISMATCH" : "identical to the reference stencil");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void bench_file(char *name) {
+    uint8_t *data;
+    ssize_t size = lh_load_alloc(name, &data);
+    if (size < 0) {
+        printf("Failed to load %s\n", name);
+        return;
+    }
+
+    bench_t b;
+
+    if (o_compare) {
+        // reference run with a new zlib context for every packet
+        play_zconfig(ZB_ONESHOT, o_zlevel, o_zstrategy);
+        CLEAR(b);
+        st_reset();
+        run_replay(data, size, &b);
+        save_zcost();
+    }
+
+    if (!play_zconfig(o_zbackend, o_zlevel, o_zstrategy)) {
+        printf("Compression backend %s is not available\n", play_zbackend_name(o_zbackend));
+        lh_free(data);
+        return;
+    }
+
+    CLEAR(b);
+    st_reset();
+
+    uint64_t alloc0 = nalloc, realloc0 = nrealloc;
+    uint64_t elapsed = run_replay(data, size, &b);
+
+    double sec = (double)elapsed/1000000000.0;
+    uint64_t na = nalloc-alloc0, nr = nrealloc-realloc0;
+
+    printf("%s : %d iteration(s), compression %s level=%d strategy=%s\n",
+           name, o_iterations, play_zbackend_name(play_zopt.backend),
+           play_zopt.level, play_zstrategy_name(play_zopt.strategy));
+    printf("  packets     : %jd in %.3f s, %.0f packets/s\n",
+           (intmax_t)b.npackets, sec, sec>0 ? b.npackets/sec : 0.0);
+    printf("  data in     : %.2f MB, %.2f MB/s\n",
+           MB(b.bytes_in), sec>0 ? MB(b.bytes_in)/sec : 0.0);
+    printf("  data out    : %.2f MB, %.2f MB/s\n",
+           MB(b.bytes_out), sec>0 ? MB(b.bytes_out)/sec : 0.0);
+    printf("  allocations : %jd (+%jd reallocs), %.1f per packet\n",
+           (intmax_t)na, (intmax_t)nr, b.npackets ? (double)na/b.npackets : 0.0);
+
+    st_dump(o_pertype);
+
+    if (o_compare)
+        compare_zcost();
+
+    if (o_export)
+        bench_export();
+
+    if (o_tunnel)
+        check_tunnel();
+
+    lh_free(data);
+}
+
+int main(int ac, char **av) {
+    if (!parse_args(ac,av) || o_help) {
+        print_usage();
+        return !o_help;
+    }
+
+    int i;
+    for(i=optind; av[i]; i++)
+        bench_file(av[i]);
+
+    gs_destroy();
+    gm_reset();
+
+    return 0;
+}
@@ -6,6 +6,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #define LH_DECLARE_SHORT_NAMES 1
 
@@ -28,6 +30,8 @@
 #define STATE_LOGIN    2
 #define STATE_PLAY     3
 
+#define MAXCLUSTER 32   // largest spawner cluster size for -K
+
 #define INTSWAP(x,y) { int temp=(x); (x)=(y); (y)=temp; }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -61,6 +65,9 @@ int o_xmin                      = -60000;
 int o_zmin                      = -60000;
 int o_xmax                      =  60000;
 int o_zmax                      =  60000;
+int o_threads                   = 0;
+int o_cluster                   = 0;
+int o_spawner_bench             = 0;
 
 void print_usage() {
     printf("Usage:\n"
@@ -69,6 +76,8 @@ void print_usage() {
            "  -b id[:meta]              : search for blocks by block ID and optionally meta value\n"
            "  -s                        : search for multiple-spawner locations\n"
            "  -S                        : search for single spawner locations\n"
+           "  -K size                   : search for clusters of at least this many spawners (4 or more)\n"
+           "  -G count                  : benchmark the spawner search on a synthetic set of spawners\n"
            "  -i                        : track inventory transactions and dump inventory\n"
            "  -t                        : track thunder sounds\n"
            "  -p                        : dump player list\n"
@@ -81,13 +90,14 @@ void print_usage() {
            "  -D dimension              : specify dimension (0:overworld, -1:nether, 1:end)\n"
            "  -L xmin,zmin,xmax,zmax    : limit the area from which chunks will be stored, in regions\n"
            "  -W                        : search for flat bedrock formations suitable for wither spawning\n"
+           "  -T threads                : number of threads for the -b and -W searches, default: all CPUs\n"
     );
 }
 
 int parse_args(int ac, char **av) {
     int opt,error=0;
 
-    while ( (opt=getopt(ac,av,"b:D:B:H:A:L:sSihmdtpWe")) != -1 ) {
+    while ( (opt=getopt(ac,av,"b:D:B:H:A:L:T:K:G:sSihmdtpWe")) != -1 ) {
         switch (opt) {
             case 'h':
                 o_help = 1;
@@ -164,6 +174,28 @@ int parse_args(int ac, char **av) {
                 o_reglimit = 1;
                 break;
             }
+            case 'K': {
+                if (sscanf(optarg, "%d", &o_cluster)!=1 || o_cluster<4 || o_cluster>MAXCLUSTER) {
+                    printf("-K : cluster size must be between 4 and %d\n", MAXCLUSTER);
+                    error++;
+                }
+                o_spawner_mult = 1;
+                break;
+            }
+            case 'G': {
+                if (sscanf(optarg, "%d", &o_spawner_bench)!=1 || o_spawner_bench<1) {
+                    printf("-G : number of spawners must be a positive number\n");
+                    error++;
+                }
+                break;
+            }
+            case 'T': {
+                if (sscanf(optarg, "%d", &o_threads)!=1 || o_threads<1) {
+                    printf("-T : number of threads must be a positive number\n");
+                    error++;
+                }
+                break;
+            }
             case '?': {
                 printf("Unknown option -%c", opt);
                 error++;
@@ -172,7 +204,7 @@ int parse_args(int ac, char **av) {
         }
     }
 
-    if (!av[optind]) error++;
+    if (!av[optind] && !o_spawner_bench) error++;
 
     return error==0;
 }
@@ -216,13 +248,31 @@ void dump_players() {
 #define MAXDIST 31.0
 #define SQ(x) ((x)*(x))
 
+// spawners are bucketed in a 3D grid of cubic cells with a size of at least
+// MAXDIST, so all spawners close to a spawner are in its own or neighbor cells
+#define SPGRID_SHIFT    5
+#define SPGRID_HSIZE    65536
+#define SPGRID_HASH(cx,cy,cz) ((((uint32_t)(cx)*73856093U)^((uint32_t)(cy)*19349663U)^((uint32_t)(cz)*83492791U))&(SPGRID_HSIZE-1))
+
 typedef struct {
     pos_t loc;
     int   type;
+    int32_t next;       // next spawner in the same grid hash bucket
 } spawner_t;
 
 lh_arr_declare_i(spawner_t, spawners);
 
+// grid hash buckets - chain links are spawner index+1, 0 terminates
+static int32_t spgrid[SPGRID_HSIZE];
+
+typedef struct {
+    int dbl, trp, clu;
+} spcount;
+
+typedef struct {
+    lh_arr_declare(int32_t, idx);
+} spnear;
+
 static inline float pos_dist(pos_t a, pos_t b) {
     int32_t dx = a.x-b.x;
     int32_t dy = a.y-b.y;
@@ -230,6 +280,28 @@ static inline float pos_dist(pos_t a, pos_t b) {
     return sqrtf((float)SQ(dx)+(float)SQ(dy)+(float)SQ(dz));
 }
 
+static inline char spawner_char(spawner_t *s) {
+    return (s->type==SPAWNER_ZOMBIE)?'Z':'S';
+}
+
+static void add_spawner(pos_t loc, int type) {
+    int32_t cx = loc.x>>SPGRID_SHIFT, cy = loc.y>>SPGRID_SHIFT, cz = loc.z>>SPGRID_SHIFT;
+    int32_t *head = &spgrid[SPGRID_HASH(cx,cy,cz)];
+
+    // check if this spawner was already recorded in the list
+    int32_t i;
+    for(i=*head; i; i=P(spawners)[i-1].next)
+        if (P(spawners)[i-1].loc.p == loc.p)
+            return;
+
+    // store the spawner in the list for later processing
+    spawner_t *s = lh_arr_new(GAR(spawners));
+    s->loc = loc;
+    s->type = type;
+    s->next = *head;
+    *head = C(spawners);
+}
+
 void track_spawners(nbt_t *te) {
     // determine the type of the spawner
     int type = SPAWNER_OTHER;
@@ -246,65 +318,214 @@ void track_spawners(nbt_t *te) {
     nbt_t *x = nbt_hget(te, "x"); assert(x); assert(x->type == NBT_INT);
     nbt_t *y = nbt_hget(te, "y"); assert(y); assert(y->type == NBT_INT);
     nbt_t *z = nbt_hget(te, "z"); assert(z); assert(z->type == NBT_INT);
-    pos_t loc = POS(x->i,y->i,z->i);
 
-    // check if this spawner was already recorded in the list
+    add_spawner(POS(x->i,y->i,z->i), type);
+}
+
+static int int_compar(const void *a, const void *b) {
+    return *(const int32_t *)a - *(const int32_t *)b;
+}
+
+// collect the indices of all spawners closer than MAXDIST to spawner i,
+// in ascending order
+static void near_spawners(int32_t i, spnear *res) {
+    pos_t loc = P(spawners)[i].loc;
+    int32_t cx = loc.x>>SPGRID_SHIFT, cy = loc.y>>SPGRID_SHIFT, cz = loc.z>>SPGRID_SHIFT;
+
+    C(res->idx) = 0;
+    int dx,dy,dz;
+    for(dx=-1; dx<=1; dx++)
+        for(dy=-1; dy<=1; dy++)
+            for(dz=-1; dz<=1; dz++) {
+                int32_t j;
+                for(j=spgrid[SPGRID_HASH(cx+dx,cy+dy,cz+dz)]; j; j=P(spawners)[j-1].next) {
+                    spawner_t *s = P(spawners)+j-1;
+
+                    // the bucket may also hold spawners from other cells
+                    if ((s->loc.x>>SPGRID_SHIFT)!=cx+dx || (s->loc.y>>SPGRID_SHIFT)!=cy+dy ||
+                        (s->loc.z>>SPGRID_SHIFT)!=cz+dz)
+                        continue;
+
+                    if (j-1 != i && pos_dist(loc, s->loc) < MAXDIST)
+                        *lh_arr_new(GAR(res->idx)) = j-1;
+                }
+            }
+
+    qsort(P(res->idx), C(res->idx), sizeof(int32_t), int_compar);
+}
+
+static void print_cluster(const char *tag, int32_t *cl, int n) {
+    pos_t center = POS(0,0,0);
+    int32_t cx=0, cy=0, cz=0;
     int i;
-    for (i=0; i<C(spawners); i++)
-        if (P(spawners)[i].loc.p == loc.p)
-            return;
+    for(i=0; i<n; i++) {
+        cx += P(spawners)[cl[i]].loc.x;
+        cy += P(spawners)[cl[i]].loc.y;
+        cz += P(spawners)[cl[i]].loc.z;
+    }
+    center.x = cx/n;
+    center.y = cy/n;
+    center.z = cz/n;
+
+    printf("%-4s", tag);
+    for(i=0; i<n; i++) {
+        spawner_t *s = P(spawners)+cl[i];
+        printf(" %c:%5d,%2d,%5d", spawner_char(s), s->loc.x, s->loc.y, s->loc.z);
+    }
+    for(i=0; i<n; i++)
+        printf("%s%.1f", i ? "," : " dist=", pos_dist(P(spawners)[cl[i]].loc, center));
+    printf("\n");
+}
 
-    // store the spawner in the list for later processing
-    spawner_t *s = lh_arr_new(GAR(spawners));
-    s->loc = loc;
-    s->type = type;
+// whether spawner k is within MAXDIST of all cluster members
+static inline int fits_cluster(int32_t k, int32_t *cl, int n) {
+    int i;
+    for(i=0; i<n; i++)
+        if (cl[i]==k || pos_dist(P(spawners)[k].loc, P(spawners)[cl[i]].loc) >= MAXDIST)
+            return 0;
+    return 1;
 }
 
-static void find_spawners() {
+// extend the cluster cl with the spawners near its first member, trying
+// the ones with a higher index than the first member, starting at ni.
+// Reports all maximal clusters with at least o_cluster spawners
+static int grow_cluster(int32_t *cl, int n, spnear *nb, int ni, int print) {
+    int i, found = 0, grown = 0;
+    if (n < MAXCLUSTER) {
+        for(i=ni; i<C(nb->idx); i++) {
+            int32_t k = P(nb->idx)[i];
+            if (k < cl[0] || !fits_cluster(k, cl, n)) continue;
+            cl[n] = k;
+            found += grow_cluster(cl, n+1, nb, i+1, print);
+            grown = 1;
+        }
+    }
+    if (grown || n < o_cluster) return found;
+
+    // skipped spawners or ones with a lower index may still extend the cluster
+    for(i=0; i<C(nb->idx); i++)
+        if (fits_cluster(P(nb->idx)[i], cl, n))
+            return found;
+
+    if (print) {
+        char tag[8];
+        sprintf(tag, "K%d", n);
+        print_cluster(tag, cl, n);
+    }
+    return found+1;
+}
+
+static spcount find_spawners(int print) {
+    spcount cnt = { 0, 0, 0 };
+    spnear nb;
+    CLEAR(nb);
+
+    int32_t i,j,k;
+    for(i=0; i<C(spawners); i++) {
+        spawner_t *a = P(spawners)+i;
+        near_spawners(i, &nb);
+
+        for(j=0; j<C(nb.idx); j++) {
+            if (P(nb.idx)[j] < i) continue;
+            spawner_t *b = P(spawners)+P(nb.idx)[j];
+
+            cnt.dbl++;
+            if (print)
+                printf("DBL  %c:%5d,%2d,%5d %c:%5d,%2d,%5d dist=%.1f\n",
+                       spawner_char(a), a->loc.x,a->loc.y,a->loc.z,
+                       spawner_char(b), b->loc.x,b->loc.y,b->loc.z,
+                       pos_dist(a->loc, b->loc));
+
+            // try to find triple-spawners - the third one must be
+            // close to a as well, so it's among the spawners near a
+            for(k=0; k<C(nb.idx); k++) {
+                if (k==j) continue;
+                spawner_t *c = P(spawners)+P(nb.idx)[k];
+                if (pos_dist(b->loc, c->loc) < MAXDIST) {
+                    int32_t cl[3] = { i, P(nb.idx)[j], P(nb.idx)[k] };
+                    cnt.trp++;
+                    if (print) print_cluster("TRP", cl, 3);
+                }
+            }
+        }
+
+        if (o_cluster) {
+            // clusters are only reported from their lowest-index member
+            int32_t cl[MAXCLUSTER] = { i };
+            cnt.clu += grow_cluster(cl, 1, &nb, 0, print);
+        }
+    }
+
+    lh_arr_free(GAR(nb.idx));
+    return cnt;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Spawner search benchmark
+
+// reference implementation comparing all spawner pairs, counts only
+static spcount find_spawners_pairwise() {
+    spcount cnt = { 0, 0, 0 };
     int i,j,k;
 
     for(i=0; i<C(spawners); i++) {
         for(j=i+1; j<C(spawners); j++) {
             spawner_t *a = P(spawners)+i;
             spawner_t *b = P(spawners)+j;
-            float dist = pos_dist(a->loc, b->loc);
-            if (dist < MAXDIST) {
-                printf("DBL  %c:%5d,%2d,%5d %c:%5d,%2d,%5d dist=%.1f\n",
-                       (a->type==SPAWNER_ZOMBIE)?'Z':'S',
-                       a->loc.x,a->loc.y,a->loc.z,
-                       (b->type==SPAWNER_ZOMBIE)?'Z':'S',
-                       b->loc.x,b->loc.y,b->loc.z,
-                       dist);
-
-                // try to find triple-spawners
-                for(k=0; k<C(spawners); k++) {
-                    if (k==i || k==j) continue;
-
-                    spawner_t *c = P(spawners)+k;
-                    if (pos_dist(a->loc, c->loc) < MAXDIST &&
-                        pos_dist(b->loc, c->loc) < MAXDIST) {
-
-                        pos_t center;
-                        center.x = (a->loc.x+b->loc.x+c->loc.x)/3;
-                        center.y = (a->loc.y+b->loc.y+c->loc.y)/3;
-                        center.z = (a->loc.z+b->loc.z+c->loc.z)/3;
-                        float da = pos_dist(a->loc, center);
-                        float db = pos_dist(b->loc, center);
-                        float dc = pos_dist(c->loc, center);
-
-                        printf("TRP  %c:%5d,%2d,%5d %c:%5d,%2d,%5d %c:%5d,%2d,%5d dist=%.1f,%.1f,%.1f\n",
-                               (a->type==SPAWNER_ZOMBIE)?'Z':'S',
-                               a->loc.x,a->loc.y,a->loc.z,
-                               (b->type==SPAWNER_ZOMBIE)?'Z':'S',
-                               b->loc.x,b->loc.y,b->loc.z,
-                               (c->type==SPAWNER_ZOMBIE)?'Z':'S',
-                               c->loc.x,c->loc.y,c->loc.z,
-                               da,db,dc);
-                    }
-                }
+            if (pos_dist(a->loc, b->loc) >= MAXDIST) continue;
+            cnt.dbl++;
+
+            for(k=0; k<C(spawners); k++) {
+                if (k==i || k==j) continue;
+                spawner_t *c = P(spawners)+k;
+                if (pos_dist(a->loc, c->loc) < MAXDIST &&
+                    pos_dist(b->loc, c->loc) < MAXDIST)
+                    cnt.trp++;
             }
         }
     }
+    return cnt;
+}
+
+// synthetic world with dungeon groups packed much denser than in a real
+// world - 1..6 spawners within a 40-block radius of each group center
+static void generate_spawners(int num) {
+    int32_t area = (int32_t)sqrt(num)*48;
+    srand(1);
+
+    while (C(spawners) < num) {
+        int32_t gx = rand()%area-area/2;
+        int32_t gz = rand()%area-area/2;
+        int32_t gy = 12+rand()%40;
+        int n = 1+rand()%6;
+        while (n-- > 0 && C(spawners) < num) {
+            int32_t x = gx+rand()%81-40;
+            int32_t z = gz+rand()%81-40;
+            int32_t y = MAX(1,MIN(gy+rand()%17-8,250));
+            add_spawner(POS(x,y,z), (rand()&1) ? SPAWNER_ZOMBIE : SPAWNER_SKELETON);
+        }
+    }
+}
+
+static void bench_spawners(int num) {
+    generate_spawners(num);
+
+    uint64_t t = gettimestamp();
+    spcount g = find_spawners(0);
+    uint64_t tg = gettimestamp()-t;
+
+    printf("Spawner search, %jd spawners: DBL=%d TRP=%d", (intmax_t)C(spawners), g.dbl, g.trp);
+    if (o_cluster) printf(" K%d+=%d", o_cluster, g.clu);
+    printf("\n  grid     : %10.3f ms\n", tg/1000.0);
+
+    // the pairwise search takes hours for large sets
+    if (num <= 20000) {
+        t = gettimestamp();
+        spcount p = find_spawners_pairwise();
+        uint64_t tp = gettimestamp()-t;
+        printf("  pairwise : %10.3f ms%s\n", tp/1000.0,
+               (p.dbl==g.dbl && p.trp==g.trp) ? "" : " MISMATCH");
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -687,107 +908,227 @@ void parse_mcp(uint8_t *data, ssize_t size, char * name) {
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// Parallel chunk search
 
-void search_blocks(gsworld *w, int bid, int meta) {
-    assert(w);
+// The chunks of a world are split between the threads, every thread
+// collects its hits separately. The hits are sorted by their position in
+// the chunk storage afterwards, so the output does not depend on the threads
 
-    int s,r,c,i;
-    for(s=0; s<512*512; s++) {
-        gssreg *sr = w->sreg[s];
-        if (!sr) continue;
+#define SEARCH_MAXTHREADS 64
 
-        for(r=0; r<256*256; r++) {
-            gsregion *re = sr->region[r];
-            if (!re) continue;
+typedef struct {
+    uint64_t    key;        // chunk storage position << 16 | offset within chunk
+    int32_t     x,y,z;
+    bid_t       b;
+} hit_t;
+
+struct _searcher;
+typedef void (*scanfunc_t)(struct _searcher *s, gschunk *gc);
+
+typedef struct _searcher {
+    gsworld    *w;
+    scanfunc_t  scan;
+    int         bid, meta;
+    int         tid, nthreads;
+    lh_arr_declare(hit_t, hits);
+} searcher;
+
+// chunk position in the order of the sreg/region/chunk storage
+static inline uint64_t chunk_key(gschunk *gc) {
+    return ((uint64_t)CC_2(gc->X,gc->Z)<<26)|((uint64_t)CC_1(gc->X,gc->Z)<<10)|CC_0(gc->X,gc->Z);
+}
 
-            for(c=0; c<32*32; c++) {
-                gschunk *ch = re->chunk[c];
-                if (!ch) continue;
+static inline void add_hit(searcher *s, gschunk *gc, int off, int32_t x, int32_t y, int32_t z, bid_t b) {
+    hit_t *h = lh_arr_new(GAR(s->hits));
+    h->key = (chunk_key(gc)<<16)|off;
+    h->x = x;
+    h->y = y;
+    h->z = z;
+    h->b = b;
+}
 
-                int32_t X = CC_X(s,r,c);
-                int32_t Z = CC_Z(s,r,c);
+static int hit_compar(const void *a, const void *b) {
+    const hit_t *ha = a, *hb = b;
+    return (ha->key > hb->key) - (ha->key < hb->key);
+}
 
-                for(i=0; i<65536; i++) {
-                    bid_t bl = ch->blocks[i];
-                    if (bl.bid == bid && (meta<0 || bl.meta == meta) ) {
-                        int32_t x = (X*16+(i&0xf));
-                        int32_t z = (Z*16+((i>>4)&0xf));
-                        int32_t y = i>>8;
+// chunk lookup without the side effects of find_chunk, safe to use from the threads
+static gschunk * peek_chunk(gsworld *w, int32_t X, int32_t Z) {
+    gssreg *sr = w->sreg[CC_2(X,Z)];
+    if (!sr) return NULL;
+    gsregion *re = sr->region[CC_1(X,Z)];
+    if (!re) return NULL;
+    return re->chunk[CC_0(X,Z)];
+}
 
-                        printf("Block %3d:%2d at %5d,%5d,%3d\n",
-                               bl.bid, bl.meta, x, z, y);
-                    }
-                }
+// compare a row of 16 blocks against a pattern, 4 blocks at a time.
+// pat is the wanted raw bid_t value in every 16-bit lane, mask selects the
+// compared bits. Returns a bitmask of the matching blocks
+static inline uint32_t row_match(bid_t *row, uint64_t pat, uint64_t mask) {
+    uint32_t m = 0;
+    int i;
+    for(i=0; i<4; i++) {
+        uint64_t w;
+        memcpy(&w, row+i*4, sizeof(w));
+        w = (w^pat)&mask;
+
+        // set the top bit of every zero 16-bit lane, then gather
+        // the four top bits into the low nibble
+        uint64_t t = ~((((w&0x7fff7fff7fff7fffULL)+0x7fff7fff7fff7fffULL)|w))&0x8000800080008000ULL;
+        m |= (uint32_t)(((t>>15)*0x0001000200040008ULL)>>48)<<(i*4);
+    }
+    return m;
+}
+
+static void * search_thread(void *arg) {
+    searcher *s = arg;
+    int i;
+    for(i=s->tid; i<C(s->w->chunks); i+=s->nthreads)
+        s->scan(s, P(s->w->chunks)[i]);
+    return NULL;
+}
+
+// run a scan function on all chunks of a world, return the sorted hits
+static hit_t * search_chunks(gsworld *w, scanfunc_t scan, int bid, int meta, ssize_t *nhits) {
+    int nthreads = o_threads;
+    if (nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = MAX(1,MIN(nthreads,SEARCH_MAXTHREADS));
+
+    searcher s[SEARCH_MAXTHREADS];
+    pthread_t th[SEARCH_MAXTHREADS];
+    CLEAR(s);
+
+    int t, started[SEARCH_MAXTHREADS];
+    for(t=0; t<nthreads; t++) {
+        s[t].w        = w;
+        s[t].scan     = scan;
+        s[t].bid      = bid;
+        s[t].meta     = meta;
+        s[t].tid      = t;
+        s[t].nthreads = nthreads;
+
+        // if a thread can't be started, its share is scanned right here
+        started[t] = !pthread_create(&th[t], NULL, search_thread, &s[t]);
+        if (!started[t])
+            search_thread(&s[t]);
+    }
+
+    ssize_t n = 0;
+    for(t=0; t<nthreads; t++) {
+        if (started[t])
+            pthread_join(th[t], NULL);
+        n += C(s[t].hits);
+    }
+
+    lh_create_num(hit_t, hits, MAX(n,1));
+    n = 0;
+    for(t=0; t<nthreads; t++) {
+        memmove(hits+n, P(s[t].hits), C(s[t].hits)*sizeof(hit_t));
+        n += C(s[t].hits);
+        lh_arr_free(GAR(s[t].hits));
+    }
+    qsort(hits, n, sizeof(hit_t), hit_compar);
+
+    *nhits = n;
+    return hits;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void scan_blocks(searcher *s, gschunk *gc) {
+    uint16_t want = (s->bid<<4)|(s->meta<0 ? 0 : s->meta);
+    uint64_t pat  = want*0x0001000100010001ULL;
+    uint64_t mask = (s->meta<0) ? 0xfff0fff0fff0fff0ULL : 0xffffffffffffffffULL;
+
+    int sec,r;
+    for(sec=0; sec<16; sec++) {
+        if (!(gc->bmask[sec] & BMASK_BIT(s->bid))) continue;
+
+        for(r=sec*256; r<sec*256+256; r++) {
+            uint32_t m = row_match(gc->blocks+r*16, pat, mask);
+            while (m) {
+                int i = r*16+__builtin_ctz(m);
+                add_hit(s, gc, i, gc->X*16+(i&0xf), i>>8, gc->Z*16+((i>>4)&0xf), gc->blocks[i]);
+                m &= m-1;
             }
         }
     }
 }
 
+void search_blocks(gsworld *w, int bid, int meta) {
+    assert(w);
+
+    ssize_t i,n;
+    hit_t *hits = search_chunks(w, scan_blocks, bid, meta, &n);
+    for(i=0; i<n; i++)
+        printf("Block %3d:%2d at %5d,%5d,%3d\n",
+               hits[i].b.bid, hits[i].b.meta, hits[i].x, hits[i].z, hits[i].y);
+    lh_free(hits);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-void search_flat_bedrock() {
-    gsworld * oldworld = gs.world;
-    gs.world = &gs.nether;
-    gsworld *w = gs.world;
+#define BEDROCK_PAT  (0x70*0x0001000100010001ULL)
+#define BEDROCK_MASK 0xfff0fff0fff0fff0ULL
 
-    int s,r,c,i;
-    for(s=0; s<512*512; s++) {
-        gssreg *sr = w->sreg[s];
-        if (!sr) continue;
+// bedrock bits of the block row z (-1..16) at height y in the 3x3 chunk
+// neighborhood nb, bit x+1 is set for x=-1..16
+static uint32_t bedrock_row(gschunk *nb[3][3], int z, int y) {
+    gschunk **cr = nb[(z<0) ? 0 : (z>15) ? 2 : 1];
+    bid_t *row;
+    uint32_t m = 0;
 
-        for(r=0; r<256*256; r++) {
-            gsregion *re = sr->region[r];
-            if (!re) continue;
+    if (cr[1]) {
+        row = cr[1]->blocks+(y<<8)+((z&15)<<4);
+        m |= row_match(row, BEDROCK_PAT, BEDROCK_MASK)<<1;
+    }
+    if (cr[0] && cr[0]->blocks[(y<<8)+((z&15)<<4)+15].bid == 7)  m |= 1;
+    if (cr[2] && cr[2]->blocks[(y<<8)+((z&15)<<4)].bid == 7)     m |= 1<<17;
 
-            for(c=0; c<32*32; c++) {
-                gschunk *ch = re->chunk[c];
-                if (!ch) continue;
+    return m;
+}
 
-                int32_t X = CC_X(s,r,c);
-                int32_t Z = CC_Z(s,r,c);
+// 3x3 bedrock ceiling with two non-bedrock blocks below the center
+static void scan_flat_bedrock(searcher *s, gschunk *gc) {
+    if (!(gc->bmask[7] & BMASK_BIT(7))) return;
+
+    gschunk *nb[3][3];
+    int dx,dz,y,z;
+    for(dz=-1; dz<=1; dz++)
+        for(dx=-1; dx<=1; dx++)
+            nb[dz+1][dx+1] = peek_chunk(s->w, gc->X+dx, gc->Z+dz);
+
+    for(y=123; y<125; y++) {
+        // horizontal runs of 3 bedrock blocks centered on each x
+        uint32_t h[18];
+        for(z=-1; z<=16; z++) {
+            uint32_t r = bedrock_row(nb, z, y);
+            h[z+1] = r & (r<<1) & (r>>1);
+        }
 
-                int x,y,z;
-                for(y=123; y<125; y++) {
-                    for(x=0; x<16; x++) {
-                        for(z=0; z<16; z++) {
-                            int32_t xx = X*16+x;
-                            int32_t zz = Z*16+z;
-
-                            bid_t blk[] = {
-                                get_block_at(xx-1,zz-1,y),
-                                get_block_at(xx-1,zz,y),
-                                get_block_at(xx-1,zz+1,y),
-                                get_block_at(xx,zz-1,y),
-                                get_block_at(xx,zz,y),
-                                get_block_at(xx,zz+1,y),
-                                get_block_at(xx+1,zz-1,y),
-                                get_block_at(xx+1,zz,y),
-                                get_block_at(xx+1,zz+1,y),
-
-                                get_block_at(xx,zz,y-1),
-                                get_block_at(xx,zz,y-2),
-                            };
-
-                            if (blk[0].bid  == 7 &&
-                                blk[1].bid  == 7 &&
-                                blk[2].bid  == 7 &&
-                                blk[3].bid  == 7 &&
-                                blk[4].bid  == 7 &&
-                                blk[5].bid  == 7 &&
-                                blk[6].bid  == 7 &&
-                                blk[7].bid  == 7 &&
-                                blk[8].bid  == 7 &&
-                                blk[9].bid  != 7 &&
-                                blk[10].bid != 7)
-                                printf("Flat Bedrock at %d,%d y=%d\n",xx,zz,y);
-                        }
-                    }
-                }
+        for(z=0; z<16; z++) {
+            uint32_t c = (h[z]&h[z+1]&h[z+2])>>1;
+            bid_t *b1 = gc->blocks+((y-1)<<8)+(z<<4);
+            bid_t *b2 = gc->blocks+((y-2)<<8)+(z<<4);
+            c &= ~row_match(b1, BEDROCK_PAT, BEDROCK_MASK);
+            c &= ~row_match(b2, BEDROCK_PAT, BEDROCK_MASK);
+            c &= 0xffff;
+
+            while (c) {
+                int x = __builtin_ctz(c);
+                add_hit(s, gc, (y<<8)|(x<<4)|z, gc->X*16+x, y, gc->Z*16+z, BLOCKTYPE(7,0));
+                c &= c-1;
             }
         }
     }
+}
 
-    gs.world = oldworld;
+void search_flat_bedrock() {
+    ssize_t i,n;
+    hit_t *hits = search_chunks(&gs.nether, scan_flat_bedrock, 7, -1, &n);
+    for(i=0; i<n; i++)
+        printf("Flat Bedrock at %d,%d y=%d\n",hits[i].x,hits[i].z,hits[i].y);
+    lh_free(hits);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -799,6 +1140,11 @@ int main(int ac, char **av) {
         return !o_help;
     }
 
+    if (o_spawner_bench) {
+        bench_spawners(o_spawner_bench);
+        return 0;
+    }
+
     gs_reset();
     gs_setopt(GSOP_PRUNE_CHUNKS, 0);
 
@@ -848,7 +1194,7 @@ int main(int ac, char **av) {
     }
 
     if (o_spawner_mult)
-        find_spawners();
+        find_spawners(1);
 
     if (o_block_id >=0)
         search_blocks(o_world, o_block_id, o_block_meta);
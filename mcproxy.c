@@ -53,6 +53,8 @@
 #include "mcp_gamestate.h"
 #include "mcp_game.h"
 #include "mcp_build.h"
+#include "mcp_stats.h"
+#include "mcp_play.h"
 
 // forward declaration
 int query_auth_server();
@@ -70,6 +72,9 @@ char         o_raddr[256];
 uint16_t     o_rport;
 int          o_connactive = 0;
 char *       o_profile_path = NULL;
+char *       o_cachedir = NULL;
+int          o_cachemb = 256;
+int          o_maxmb = 0;
 
 uint32_t     bind_ip;
 uint32_t     remote_ip;
@@ -89,6 +94,13 @@ void signal_handler(int signum) {
     signal_caught = 1;
 }
 
+// SIGUSR1 requests a dump of the latency statistics
+int stats_requested;
+
+void stats_signal_handler(int signum) {
+    stats_requested = 1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 lh_pollarray pa;
@@ -154,8 +166,6 @@ struct {
 
     FILE * output;
     FILE * dbg;
-
-    int comptr; // compression threshold, -1 means compression is disabled
 } mitm;
 
 uint32_t remote_addr;
@@ -163,18 +173,6 @@ uint16_t remote_port;
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void write_packet_raw(uint8_t *ptr, ssize_t len, lh_buf_t *buf) {
-    uint8_t hbuf[16]; CLEAR(hbuf);
-    ssize_t ll = lh_place_varint(hbuf,len) - hbuf;
-
-    ssize_t widx = buf->C(data);
-
-    lh_arr_add(GAR4(buf->data),(len+ll));
-
-    memmove(P(buf->data)+widx, hbuf, ll);
-    memmove(P(buf->data)+widx+ll, ptr, len);
-}
-
 void process_encryption_request(uint8_t *p, lh_buf_t *forw) {
     SL_EncryptionRequest_pkt pkt;
     decode_encryption_request(&pkt, p);
@@ -218,7 +216,7 @@ void process_encryption_request(uint8_t *p, lh_buf_t *forw) {
     uint8_t output[65536];
     uint8_t *w = output;
 
-    if (mitm.comptr>=0) {
+    if (play_comptr>=0) {
         printf("Warning: sending pseudo-compressed Encryption Request\n");
         write_varint(w, 0);
     }
@@ -270,7 +268,7 @@ void process_encryption_response(uint8_t *p, lh_buf_t *forw) {
     uint8_t output[65536];
     uint8_t *w = output;
 
-    if (mitm.comptr>=0) {
+    if (play_comptr>=0) {
         printf("Warning: sending pseudo-compressed Encryption Response\n");
         write_varint(w, 0);
     }
@@ -309,7 +307,7 @@ void process_packet(int is_client, uint8_t *ptr, ssize_t len, lh_buf_t *tx, lh_b
 
     uint8_t *p = ptr;
 
-    if (mitm.comptr>=0) {
+    if (play_comptr>=0) {
         // compression is active
         // quick-and-dirty for compressed packets during the login phase
         // just strip the leading 0 byte
@@ -375,8 +373,8 @@ void process_packet(int is_client, uint8_t *ptr, ssize_t len, lh_buf_t *tx, lh_b
             break;
 
         case SL_SetCompression: {
-            mitm.comptr = lh_read_varint(p);
-            //printf("SetCompression during login phase! threshold=%d\n", mitm.comptr);
+            play_comptr = lh_read_varint(p);
+            //printf("SetCompression during login phase! threshold=%d\n", play_comptr);
             write_packet_raw(ptr, len, tx);
             break;
         }
@@ -396,136 +394,6 @@ void process_packet(int is_client, uint8_t *ptr, ssize_t len, lh_buf_t *tx, lh_b
     }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-uint8_t ubuf[MCP_MAXPLEN];
-uint8_t cbuf[MCP_MAXPLEN];
-#define LIM64(len) ((len)>64?64:(len))
-#define LIM128(len) ((len)>128?128:(len))
-
-void write_packet(MCPacket *pkt, lh_buf_t *tx) {
-    ssize_t ulen = encode_packet(pkt, ubuf);
-
-    if (mitm.comptr >= 0) {
-        // compression is active
-        uint8_t *w = cbuf;
-        ssize_t clen = 0;
-        if (ulen >= mitm.comptr) {
-            // length is at or over threshold - compress it
-            write_varint(w, (int32_t)ulen);
-            clen = lh_zlib_encode_to(ubuf, ulen, w, cbuf+sizeof(cbuf)-w);
-            assert(clen > 0);
-        }
-        else {
-            // packet is below compression threshold, send uncompressed
-            write_varint(w, 0);
-            memmove(w, ubuf, ulen);
-            clen = ulen;
-        }
-        clen += (w-cbuf);
-        write_packet_raw(cbuf, clen, tx);
-
-#if 0
-        printf("%c P clen=%6zd    ",pkt->cl?'C':'S',clen);
-        hexprint(cbuf, LIM64(clen));
-#endif
-
-    }
-    else {
-        // no compression - simply append the packet to the transmission buffer
-        write_packet_raw(ubuf, ulen, tx);
-#if 0
-        printf("%c P ulen=%6zd    ",pkt->cl?'C':'S',ulen);
-        hexprint(ubuf, LIM64(ulen));
-#endif
-
-    }
-}
-
-void flush_queue(MCPacketQueue *q, lh_buf_t *qx) {
-    int i;
-    for(i=0; i<C(q->queue); i++) {
-        MCPacket * pkt = P(q->queue)[i];
-        write_packet(pkt, qx);
-        free_packet(pkt);
-    }
-    lh_free(P(q->queue));
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-void process_play_packet(int is_client, struct timeval ts,
-                         uint8_t *ptr, uint8_t *lim,
-                         lh_buf_t *tx, lh_buf_t *bx) {
-
-    char comp=' ';
-
-    uint8_t *raw_ptr = ptr;       // start of the raw packet (with the complen field)
-    //uint8_t *raw_lim = lim;       // limit ptr of the raw data
-    ssize_t  raw_len = lim-ptr;   // and its length
-
-    uint8_t *p       = ptr;       // decoding pointer, after passing the decomp code
-                                  // it should be pointing at the packet type field
-    uint8_t *plim    = lim;       // limit ptr of the packet data
-    ssize_t  plen    = plim-p;    // length of the decompressed data
-
-    if (mitm.comptr>=0) {
-        // compression is enabled
-        comp = '.';
-        int32_t usize = lh_read_varint(p); // supposed size of uncompressed data
-
-        if (usize>0) {
-            // packet is compressed - uncompress into temp buffer
-            comp = '*';
-            plen = lh_zlib_decode_to(p,plen,ubuf,usize);
-            if (plen != usize) {
-                printf("Failed to decompress packet, expected %d bytes, zlib returned %zd. Skipping packet. Some decompressed data shown below:\n", usize, plen);
-                hexdump(ubuf, 64);
-                return;
-            }
-
-            // correct p and lim to match the decompressed packet
-            p=ubuf;
-            plim = p+plen;
-        }
-        // usize==0 means the packet is not compressed, so in effect we simply
-        // moved the decoding pointer to the start of the actual packet data
-
-        plen = plim-p;
-    }
-
-#if 0
-    printf("%c P  len=%6zd %c  ",is_client?'C':'S',raw_len,comp);
-    hexprint(raw_ptr, LIM64(raw_len));
-#endif
-
-#if 0
-    printf("%c P plen=%6zd    ",is_client?'C':'S',plen,comp);
-    hexprint(p, LIM64(plen));
-#endif
-
-    MCPacket *pkt=decode_packet(is_client, p, plen);
-    if (!pkt) {
-        printf("Failed to decode packet. Some packet data shown below (len=%zd):\n", plen);
-        hexdump(p, (plen<64)?plen:64);
-        return;
-    }
-    pkt->ts = ts;
-
-    ////////////////////////////////////////////////////////////////////////////
-
-    MCPacketQueue tq = {NULL,0}, bq = {NULL,0};
-
-    // pass the packet to both gamestate and game
-    gs_packet(pkt);
-    gm_packet(pkt, &tq, &bq);
-
-    // transmit packets in the queues, if any
-    flush_queue(&tq, tx);
-    flush_queue(&bq, bx);
-}
-
-
 ////////////////////////////////////////////////////////////////////////////////
 
 // stop current game session, close and cleanup everything
@@ -547,6 +415,9 @@ void close_session() {
     if (mitm.s_rsa) RSA_free(mitm.s_rsa);
     if (mitm.c_rsa) RSA_free(mitm.c_rsa);
 
+    // Release the compression streams
+    play_zfree();
+
     // Cleanup connection buffers
     lh_free(P(mitm.cs_rx.data));
     lh_free(P(mitm.cs_tx.data));
@@ -563,14 +434,19 @@ void close_session() {
 
     // Clear state
     CLEAR(mitm);
-    mitm.comptr = -1;
+    play_comptr = -1;
     mitm.cs = mitm.ms = -1;
     mitm.state = STATE_IDLE;
 }
 
 
+// time spent in handle_proxy, used to separate the socket I/O time
+// from the processing time of lh_conn_process
+uint64_t handler_ns;
+
 // handle data incoming on the server or client connection
 ssize_t handle_proxy(lh_conn *conn) {
+    uint64_t t0 = st_now();
     int is_client = (conn->priv != NULL);
 
     if (conn->status&CONN_STATUS_REMOTE_EOF) {
@@ -616,6 +492,7 @@ ssize_t handle_proxy(lh_conn *conn) {
         // the authentication phase is not over yet - plaintext data
         memmove(rx->P(data)+widx, sptr, slen);
     }
+    uint64_t t = st_lap(ST_DECRYPT, -1, t0);
 
     // at this point, the rx buffer contains raw, but decrypted data,
     // possibly also packets that could not be processed before
@@ -660,6 +537,7 @@ ssize_t handle_proxy(lh_conn *conn) {
 
         // decode and process packet - this will also put a forwarded
         // data and/or responses into tx and bx buffers respectively as needed
+        uint64_t tp = st_now();
         if ( mitm.state == STATE_PLAY ) {
             // PLAY packets are processed in mcp_game module
             process_play_packet(is_client, tv, p, p+plen, tx, bx);
@@ -669,12 +547,16 @@ ssize_t handle_proxy(lh_conn *conn) {
             // handle IDLE, STATUS and LOGIN packets here
             process_packet(is_client, p, plen, tx, bx);
         }
+        t += st_now()-tp; // packet processing is not part of framing
+
         // remove processed packet from the buffer
         lh_arr_delete_range(GAR4(rx->data),0,ll+plen);
     }
+    st_lap(ST_FRAMING, -1, t);
 
     // if there's data in the transmission buffer, encrypt it if needed and send off
     if (tx->C(data) > 0) {
+        t = st_now();
         if (mitm.encryption_active) {
             // since we always write out all data, we just encrypt this in-place
             int num=0;
@@ -684,15 +566,18 @@ ssize_t handle_proxy(lh_conn *conn) {
             else
                 AES_cfb8_encrypt(tx->P(data), tx->P(data), tx->C(data),
                                  &mitm.c_aes, mitm.c_enc_iv, &num, AES_ENCRYPT);
+            t = st_lap(ST_ENCRYPT, -1, t);
         }
 
         // send everything
         lh_conn_write(is_client?mitm.ms_conn:mitm.cs_conn, AR(tx->data));
+        st_lap(ST_SEND, -1, t);
         tx->C(data) = tx->ridx = 0;
     }
 
     // if there's data in the response buffer, encrypt it if needed and send off
     if (bx->C(data) > 0) {
+        t = st_now();
         if (mitm.encryption_active) {
             // since we always write out all data, we just encrypt this in-place
             int num=0;
@@ -702,10 +587,12 @@ ssize_t handle_proxy(lh_conn *conn) {
             else
                 AES_cfb8_encrypt(bx->P(data), bx->P(data), bx->C(data),
                                  &mitm.s_aes, mitm.s_enc_iv, &num, AES_ENCRYPT);
+            t = st_lap(ST_ENCRYPT, -1, t);
         }
 
         // send everything
         lh_conn_write(is_client?mitm.cs_conn:mitm.ms_conn, AR(bx->data));
+        st_lap(ST_SEND, -1, t);
         bx->C(data) = bx->ridx = 0;
     }
 
@@ -739,6 +626,7 @@ ssize_t handle_proxy(lh_conn *conn) {
         // from now on the connection is authenticated and encrypted
     }
 
+    handler_ns += st_now()-t0;
     return slen;
 }
 
@@ -1029,6 +917,12 @@ int handle_server(int sfd, uint32_t ip, uint16_t port) {
     gs_setopt(GSOP_SEARCH_SPAWNERS, 1);
     gs_setopt(GSOP_TRACK_ENTITIES, 1);
     gs_setopt(GSOP_TRACK_INVENTORY, 1);
+    gs_setopt(GSOP_MAX_MB, o_maxmb);
+    if (o_cachedir) {
+        char prefix[4096];
+        sprintf(prefix, "%s/%s", o_cachedir, o_raddr);
+        gs_chunk_cache(prefix, o_cachemb);
+    }
     gm_reset();
 
     // open a new .mcp file to capture MC protocol data
@@ -1065,7 +959,7 @@ int handle_server(int sfd, uint32_t ip, uint16_t port) {
     mitm.ms_conn = lh_conn_add(&pa, ms, G_PROXY, (void*)0);
 
     // disable compression state
-    mitm.comptr = -1;
+    play_comptr = -1;
 
     // from now on, all data arriving from the server or client will be
     // handled by handle_proxy called from the event loop
@@ -1096,6 +990,11 @@ int proxy_pump() {
     if (sigaction(SIGINT, &sa, NULL))
         LH_ERROR(1,"Failed to set sigaction\n");
 
+    stats_requested = 0;
+    sa.sa_handler = stats_signal_handler;
+    if (sigaction(SIGUSR1, &sa, NULL))
+        LH_ERROR(1,"Failed to set sigaction\n");
+
     // main event loop
     while(!signal_caught) {
         lh_poll(&pa, 1000); // poll all sockets
@@ -1107,7 +1006,10 @@ int proxy_pump() {
             handle_server(pd->fd, remote_ip, o_rport);
 
         // handle client- and server-side connection
+        uint64_t t = st_now();
+        handler_ns = 0;
         lh_conn_process(&pa, G_PROXY, handle_proxy);
+        if (handler_ns) st_record(ST_RECV, -1, st_now()-t-handler_ns);
 
         // handle asynchronous events (timers etc.)
         if (mitm.state == STATE_PLAY) {
@@ -1117,6 +1019,11 @@ int proxy_pump() {
             flush_queue(&sq, &mitm.cs_tx);
             flush_queue(&cq, &mitm.ms_tx);
         }
+
+        if (stats_requested) {
+            st_dump(1);
+            stats_requested = 0;
+        }
     }
 
     printf("Terminating...\n");
@@ -1139,6 +1046,10 @@ void print_usage() {
            "  -b [bindaddr:]bindport  : address and port to bind the proxy socket to. Default: %s:%d\n"
            "  -c                      : allow connections while session is active\n"
            "  -p profile_path         : location of Minecraft profile, default is %%APPDATA%%/.minecraft/launcher_profile.json\n"
+           "  -C cachedir[,MB]        : keep the received chunks in an on-disk cache in this directory,\n"
+           "                            limited to MB megabytes per dimension, default 256\n"
+           "  -m MB                   : limit the memory used for chunks, least recently used\n"
+           "                            chunks away from the player and the build are dropped\n"
            "  [server[:port]]         : remote Minecraft server address and port. Default: %s:%d\n",
            o_appname, DEFAULT_BIND_ADDR, DEFAULT_BIND_PORT, DEFAULT_REMOTE_ADDR, DEFAULT_REMOTE_PORT);
 }
@@ -1157,7 +1068,7 @@ int parse_args(int ac, char **av) {
     char addr[256];
     int port,nchars;
 
-    while ( (opt=getopt(ac,av,"b:hcp:")) != -1 ) {
+    while ( (opt=getopt(ac,av,"b:hcp:C:m:")) != -1 ) {
         switch (opt) {
             case 'h':
                 o_help = 1;
@@ -1185,6 +1096,24 @@ int parse_args(int ac, char **av) {
             case 'p':
                 o_profile_path = strdup(optarg);
                 break;
+            case 'm':
+                if (sscanf(optarg, "%d", &o_maxmb)!=1 || o_maxmb<0) {
+                    printf("Failed to parse memory limit \"%s\"\n", optarg);
+                    error++;
+                }
+                break;
+            case 'C': {
+                o_cachedir = strdup(optarg);
+                char *mb = strrchr(o_cachedir, ',');
+                if (mb) {
+                    *mb++ = 0;
+                    if (sscanf(mb, "%d", &o_cachemb)!=1 || o_cachemb<1) {
+                        printf("Failed to parse chunk cache size \"%s\"\n", mb);
+                        error++;
+                    }
+                }
+                break;
+            }
             case '?': {
                 printf("Unknown option -%c", opt);
                 error++;